@@ -0,0 +1,96 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "preprocess.h"
+#include "integral_archive.h"
+
+// Prints one event in the same text format as output.txt.
+void print_event(struct Archive_Event * event, int32_t * bounds) {
+    const char * feature_names[NUM_FEATURES] = {"peak", "peak_time", "cfd_time"};
+    printf("i2c_address: %d\n", event->i2c_address);
+    printf("conf_address: %d\n", event->conf_address);
+    printf("bank: %d\n", event->bank);
+    printf("fine_time: %d\n", event->fine_time);
+    printf("coarse_time: %d\n", event->coarse_time);
+    printf("trigger_number: %d\n", event->trigger_number);
+    printf("samples_after_trigger: %d\n", event->samples_after_trigger);
+    printf("look_back_samples: %d\n", event->look_back_samples);
+    printf("samples_to_be_read: %d\n", event->samples_to_be_read);
+    printf("starting_sample_number: %d\n", event->starting_sample_number);
+    printf("number_of_missed_triggers: %d\n", event->number_of_missed_triggers);
+    printf("state_machine_status: %d\n", event->state_machine_status);
+    printf("ped_generation: %d\n", event->ped_generation);
+    printf("channel_mask: %d\n", event->record[0]);
+
+    uint32_t mask = event->record[0];
+    for (int i = 0; i < CHANNEL_WORDS; i++) {
+        if (i < NUM_WINDOWS) {
+            printf("%d (%d,%d)   ", i, bounds[i*2], bounds[i*2+1]);
+        }
+        else {
+            printf("%s   ", feature_names[i-NUM_WINDOWS]);
+        }
+        int num_kept = 0;
+        for (int j = 0; j < NUM_CHANNELS; j++) {
+            if (mask & (1 << j)) {
+                int32_t value = event->record[1 + num_kept*CHANNEL_WORDS + i];
+                if (i == CHANNEL_WORDS-1 && value == CFD_NO_CROSSING) {
+                    printf(" -");
+                }
+                else if (i == CHANNEL_WORDS-1) {
+                    printf(" %.2f", (double) value / (1 << CFD_TIME_SHIFT));
+                }
+                else {
+                    printf(" %d", value);
+                }
+                num_kept++;
+            }
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]){
+
+    if (argc < 2 || argc > 4) {
+        printf("Usage: %s <archive_file> [first_event [num_events]]\n", argv[0]);
+        printf("       Prints the archived events in the output.txt format, all of them by default.\n");
+        return -1;
+    }
+
+    int archive_fd = open(argv[1], O_RDONLY);
+    if (archive_fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    struct Archive_Reader reader;
+    if (archive_reader_open(&reader, archive_fd) != 0) {
+        return -1;
+    }
+
+    uint64_t num_events = archive_num_events(&reader);
+    uint64_t first_event = (argc > 2) ? strtoull(argv[2], NULL, 10) : 0;
+    uint64_t last_event = (argc > 3) ? first_event + strtoull(argv[3], NULL, 10) : num_events;
+    if (last_event > num_events) {
+        last_event = num_events;
+    }
+
+    struct Archive_Event event;
+    for (uint64_t n = first_event; n < last_event; n++) {
+        if (archive_read_event(&reader, n, &event) != 0) {
+            printf("Archive is corrupt at event %lu.\n", (unsigned long) n);
+            archive_reader_close(&reader);
+            return -2;
+        }
+        print_event(&event, reader.header.bounds);
+    }
+
+    archive_reader_close(&reader);
+    close(archive_fd);
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define POOL_ALIGNMENT 4096 // Page aligned, as XRT needs for CL_MEM_USE_HOST_PTR
+
+/*
+ Fixed-size, page-aligned slots carved out of one allocation. The host
+ wraps each slot in a CL_MEM_USE_HOST_PTR buffer once, so a slot can be
+ decoded into, migrated, and reused after readback without any new
+ allocation or copy. The CPU-only programs use the same pool as an arena
+ for their scratch buffers.
+
+ acquire/release are not thread-safe. The threaded host hands slots
+ around through its own rings and only uses the pool for the memory.
+*/
+struct Buffer_Pool {
+    uint8_t * base;
+    size_t slot_bytes; // Rounded up to POOL_ALIGNMENT
+    int num_slots;
+    int num_free;
+    int * free_slots; // Stack of free slot indices
+};
+
+static inline int buffer_pool_init(struct Buffer_Pool * pool, size_t slot_bytes, int num_slots) {
+    pool->slot_bytes = (slot_bytes + POOL_ALIGNMENT - 1) & ~((size_t) POOL_ALIGNMENT - 1);
+    pool->num_slots = num_slots;
+    pool->num_free = num_slots;
+    if (posix_memalign((void **) &pool->base, POOL_ALIGNMENT, pool->slot_bytes * num_slots) != 0) {
+        perror("posix_memalign");
+        return -1;
+    }
+    pool->free_slots = (int *) malloc(sizeof(int) * num_slots);
+    if (pool->free_slots == NULL) {
+        perror("malloc");
+        free(pool->base);
+        return -1;
+    }
+    for (int i = 0; i < num_slots; i++) {
+        pool->free_slots[i] = num_slots - 1 - i; // Slot 0 is handed out first
+    }
+    return 0;
+}
+
+static inline void * buffer_pool_slot(struct Buffer_Pool * pool, int slot) {
+    return pool->base + (size_t) slot * pool->slot_bytes;
+}
+
+// Returns a free slot index, or -1 if every slot is in use.
+static inline int buffer_pool_acquire(struct Buffer_Pool * pool) {
+    if (pool->num_free == 0) {
+        return -1;
+    }
+    pool->num_free--;
+    return pool->free_slots[pool->num_free];
+}
+
+static inline void buffer_pool_release(struct Buffer_Pool * pool, int slot) {
+    pool->free_slots[pool->num_free] = slot;
+    pool->num_free++;
+}
+
+static inline void buffer_pool_destroy(struct Buffer_Pool * pool) {
+    free(pool->free_slots);
+    free(pool->base);
+    pool->base = NULL;
+    pool->free_slots = NULL;
+    pool->num_slots = 0;
+    pool->num_free = 0;
+}
+
+#endif // BUFFER_POOL_H
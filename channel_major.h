@@ -0,0 +1,191 @@
+#ifndef CHANNEL_MAJOR_H
+#define CHANNEL_MAJOR_H
+
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "preprocess.h"
+#include "packet_framer.h"
+
+/*
+ Channel-major waveforms for the CPU pipeline. SW_Data_Packet keeps
+ samples[sample][channel], the order they arrive in, so a per-channel
+ walk strides NUM_CHANNELS words per sample. Here samples[channel][sample]
+ puts each channel's waveform in NUM_SAMPLES*2 contiguous bytes (8 cache
+ lines), the decoder writes it that way directly, and pedestal
+ subtraction and window sums become loops over contiguous runs: one run,
+ or two when the storage cells or a window wrap around.
+
+ The kernels give the same results as the C model's ped_subtract() and
+ integral(), including its window bounds, except where those bounds leave
+ a window starting before sample 0 or ending past the last sample (a
+ short packet only wraps the end by samples_to_be_read), and the model
+ reads outside its array. Such a window is clipped to the samples here
+ (cm_window_clipped says so).
+*/
+struct Channel_Major_Packet {
+    DATA_PACKET_FIELDS(NUM_CHANNELS, NUM_SAMPLES) // samples[channel][sample]
+};
+
+// Decodes a frame that framer_next returned, zeroing the samples past
+// samples_to_be_read like frame_decode
+static inline void frame_decode_channel_major(const uint8_t * frame, struct Channel_Major_Packet * data_packet) {
+    uint16_t buf[FRAME_HEADER_WORDS];
+    frame_header_words(frame, buf);
+    FRAME_UNPACK_HEADER(buf, data_packet);
+
+    const uint8_t * p = frame + FRAME_HEADER_WORDS*FRAME_WORD_BYTES;
+    for (int i = 0; i < data_packet->samples_to_be_read + 1; i++) {
+        for (int j = 0; j < NUM_CHANNELS; j++) {
+            data_packet->samples[j][i] = frame_word(p) & 0xfff;
+            p += FRAME_WORD_BYTES;
+        }
+    }
+    int num_read = data_packet->samples_to_be_read + 1;
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        memset(data_packet->samples[j] + num_read, 0, (NUM_SAMPLES - num_read) * sizeof(data_packet->samples[j][0]));
+    }
+    data_packet->omega = frame_word(p);
+}
+
+// all_peds is the usual [2][NUM_SAMPLES][NUM_CHANNELS] table
+static inline void cm_transpose_peds(const uint16_t * all_peds, uint16_t peds[2][NUM_CHANNELS][NUM_SAMPLES]) {
+    for (int b = 0; b < 2; b++) {
+        for (int i = 0; i < NUM_SAMPLES; i++) {
+            for (int j = 0; j < NUM_CHANNELS; j++) {
+                peds[b][j][i] = all_peds[(b*NUM_SAMPLES + i)*NUM_CHANNELS + j];
+            }
+        }
+    }
+}
+
+static inline void cm_subtract_run(const uint16_t * samples, const uint16_t * peds, int16_t * out, int count) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_sub_epi16(_mm_loadu_si128((const __m128i *) (samples + i)), _mm_loadu_si128((const __m128i *) (peds + i)));
+        _mm_storeu_si128((__m128i *) (out + i), x);
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = samples[i] - peds[i];
+    }
+}
+
+static inline int32_t cm_sum_run(const int16_t * x, int count) {
+    int32_t sum = 0;
+    int i = 0;
+#ifdef __SSE2__
+    // Pairwise 16 x 16 -> 32 bit multiply-add by one widens and sums in one step
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= count; i += 8) {
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (x + i)), ones));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = _mm_cvtsi128_si32(acc);
+#endif
+    for (; i < count; i++) {
+        sum += x[i];
+    }
+    return sum;
+}
+
+// Subtracts the pedestals of the storage cells each sample came from.
+// Every sample is, like the model's ped_subtract(), the ones past
+// samples_to_be_read being the zeros the decoder leaves.
+static inline void cm_ped_subtract(const struct Channel_Major_Packet * data_packet, const uint16_t peds[2][NUM_CHANNELS][NUM_SAMPLES],
+                                   int16_t ped_sub_results[NUM_CHANNELS][NUM_SAMPLES]) {
+    int cell = data_packet->starting_sample_number;
+    int before_wrap = NUM_SAMPLES - cell;
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        const uint16_t * samples = data_packet->samples[j];
+        const uint16_t * channel_peds = peds[data_packet->bank][j];
+        cm_subtract_run(samples, channel_peds + cell, ped_sub_results[j], before_wrap);
+        cm_subtract_run(samples + before_wrap, channel_peds, ped_sub_results[j] + before_wrap, cell);
+    }
+}
+
+// The sample runs of a window, with the model's bounds arithmetic
+struct Cm_Window {
+    int start[2];
+    int count[2];
+    int clipped; // The model's window started before sample 0 or ended past the last
+};
+
+static inline void cm_window(const struct Channel_Major_Packet * data_packet, int rel_start, int rel_end, struct Cm_Window * window) {
+    int start = data_packet->fine_time + rel_start - data_packet->starting_sample_number;
+    if (start < 0) {
+        start = start + data_packet->samples_to_be_read;
+    }
+    int end = data_packet->fine_time + rel_end - data_packet->starting_sample_number;
+    if (end >= data_packet->samples_to_be_read) {
+        end = end - data_packet->samples_to_be_read;
+    }
+    int linear = (end >= start);
+    window->clipped = (start < 0 || end >= NUM_SAMPLES);
+    start = (start < 0) ? 0 : start;
+    end = (end >= NUM_SAMPLES) ? NUM_SAMPLES - 1 : end;
+    window->start[0] = start;
+    window->start[1] = 0;
+    if (linear) {
+        window->count[0] = end - window->start[0] + 1;
+        window->count[1] = 0;
+    }
+    else {
+        window->count[0] = NUM_SAMPLES - window->start[0];
+        window->count[1] = (end >= 0) ? end + 1 : 0;
+    }
+    // A start past the last sample leaves only the wrapped run
+    if (window->count[0] <= 0) {
+        window->start[0] = 0;
+        window->count[0] = 0;
+    }
+}
+
+static inline int cm_window_clipped(const struct Channel_Major_Packet * data_packet, const int * bounds) {
+    struct Cm_Window window;
+    int clipped = 0;
+    for (int w = 0; w < NUM_WINDOWS; w++) {
+        cm_window(data_packet, bounds[2*w], bounds[2*w+1], &window);
+        clipped |= window.clipped;
+    }
+    return clipped;
+}
+
+// Window integrals for every channel, and the pulse features over the last
+// (widest) window
+static inline void cm_integrals(const struct Channel_Major_Packet * data_packet, const int16_t ped_sub_results[NUM_CHANNELS][NUM_SAMPLES],
+                                const int * bounds, int32_t integrals[NUM_WINDOWS][NUM_CHANNELS],
+                                int32_t features[NUM_FEATURES][NUM_CHANNELS]) {
+    struct Cm_Window windows[NUM_WINDOWS];
+    for (int w = 0; w < NUM_WINDOWS; w++) {
+        cm_window(data_packet, bounds[2*w], bounds[2*w+1], &windows[w]);
+    }
+    const int last = NUM_WINDOWS - 1;
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        const int16_t * waveform = ped_sub_results[j];
+        for (int w = 0; w < NUM_WINDOWS; w++) {
+            integrals[w][j] = cm_sum_run(waveform + windows[w].start[0], windows[w].count[0]) +
+                              cm_sum_run(waveform + windows[w].start[1], windows[w].count[1]);
+        }
+
+        struct Pulse_Tracker tracker;
+        reset_pulse(&tracker);
+        int position = 0;
+        for (int r = 0; r < 2; r++) {
+            const int16_t * run = waveform + windows[last].start[r];
+            for (int i = 0; i < windows[last].count[r]; i++) {
+                track_pulse(&tracker, position++, run[i]);
+            }
+        }
+        features[0][j] = tracker.peak;
+        features[1][j] = bounds[2*last] + tracker.peak_position;
+        features[2][j] = pulse_cfd_time(&tracker, bounds[2*last]);
+    }
+}
+
+#endif // CHANNEL_MAJOR_H
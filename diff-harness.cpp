@@ -0,0 +1,471 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PREPROCESS_KERNEL
+#include "preprocess.h"
+#include "pre_proc_model.h"
+#include "buffer_pool.h"
+#include "packet_framer.h"
+#include "channel_major.h"
+
+/*
+ Differential harness: runs the same packets through every implementation
+ of the preprocessing math and checks each against the C model, event by
+ event, window by window and channel by channel.
+
+   model          pre-proc-model.c built as a library (pre_proc_model.h), the reference
+   channel-major  channel_major.h, the CPU pipeline's channel-major kernels
+   kernel         preprocess_batch<Default_Config>, the HLS kernel source run as
+                  plain C++ (C simulation), a batch at a time like the host
+   kernel-rows    preprocess_batch_parallel<Default_Config>, the CHANNEL_PARALLEL kernel
+
+ Every channel is kept (thresholds at INT32_MIN), so each backend's output
+ unpacks to the same [CHANNEL_WORDS][NUM_CHANNELS] table of integrals and
+ pulse features.
+
+ Each packet's window bounds are checked before any backend runs. Where
+ the model's put a window start before sample 0 or its end past the last
+ sample, the model reads outside its array, so no backend runs the packet
+ and it is counted by overrun instead. Everything else runs everywhere
+ and is compared. Samples past samples_to_be_read are zeros in every
+ backend (see frame_decode), so windows reaching them agree too. The
+ kernel wraps windows by NUM_SAMPLES-1 where the model and channel_major.h
+ wrap by samples_to_be_read, so on short packets its bounds can differ,
+ and so can its results. That drift is a mismatch like any other, unless
+ --allow-known-drift is given, which reports it separately and lets it
+ pass.
+
+ The corpus is run files, framed like the host frames them, and packets
+ generated around the pedestals. Timing covers the math only: decoding,
+ and copying each packet into the model's globals, are left out.
+*/
+#define HARNESS_BATCH_PACKETS 64 // Like the host's BATCH_SIZE
+
+// What window_checks finds
+#define OVERRUN_START 1 // A model window starts before sample 0, not run
+#define OVERRUN_END 2 // A model window ends past the last sample, not run
+#define UNREAD 4 // A model window covers samples past samples_to_be_read
+#define KERNEL_BOUNDS 8 // The kernel's window bounds differ from the model's
+
+enum Harness_Backend {
+    BACKEND_MODEL,
+    BACKEND_CHANNEL_MAJOR,
+    BACKEND_KERNEL,
+    BACKEND_KERNEL_ROWS,
+    NUM_BACKENDS
+};
+
+const char * backend_names[NUM_BACKENDS] = {"model", "channel-major", "kernel", "kernel-rows"};
+
+struct Harness_Batch {
+    int num_packets;
+    uint64_t events[HARNESS_BATCH_PACKETS]; // Index of each packet in the corpus
+    int checks[HARNESS_BATCH_PACKETS];
+    struct SW_Data_Packet packets[HARNESS_BATCH_PACKETS];
+    struct Channel_Major_Packet cm_packets[HARNESS_BATCH_PACKETS];
+};
+
+struct Mismatch {
+    uint64_t event; // Index in the corpus
+    int word; // Window, then feature
+    int channel;
+    int32_t expected;
+    int32_t got;
+    struct SW_Data_Packet header; // Only the header fields are kept
+};
+
+struct Harness {
+    int bounds[2*NUM_WINDOWS];
+    int32_t keep_all[NUM_CHANNELS];
+    uint16_t ped_tables[2*PED_TABLE_SIZE]; // Both kernel slots, generation 0 in the first
+    uint16_t cm_peds[2][NUM_CHANNELS][NUM_SAMPLES];
+    int16_t cm_ped_sub_results[NUM_CHANNELS][NUM_SAMPLES];
+    int32_t kernel_output[OUTPUT_HEADER_WORDS + HARNESS_BATCH_PACKETS*SPARSE_RECORD_MAX_WORDS];
+    int32_t results[NUM_BACKENDS][HARNESS_BATCH_PACKETS][CHANNEL_WORDS][NUM_CHANNELS];
+
+    int allow_known_drift; // Kernel mismatches on KERNEL_BOUNDS packets don't fail the run
+
+    uint64_t num_events;
+    uint64_t num_run; // Events without an overrun, run through every backend
+    uint64_t num_overrun_start;
+    uint64_t num_overrun_end;
+    uint64_t num_unread;
+    uint64_t num_kernel_bounds;
+    double seconds[NUM_BACKENDS];
+    uint64_t num_mismatched[NUM_BACKENDS]; // Events
+    uint64_t num_drifted[NUM_BACKENDS]; // Events, with allow_known_drift
+    struct Mismatch first_mismatch[NUM_BACKENDS];
+    struct Mismatch first_drift[NUM_BACKENDS];
+};
+
+static struct Harness harness;
+static struct Harness_Batch batch;
+
+double seconds_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Unpacks sparse records, mask first, into the dense per-event table
+const int32_t * unpack_record(const int32_t * record, int32_t results[CHANNEL_WORDS][NUM_CHANNELS]) {
+    uint32_t mask = record[0];
+    const int32_t * words = record + 1;
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        for (int i = 0; i < CHANNEL_WORDS; i++) {
+            results[i][j] = (mask & (1u << j)) ? words[i] : 0;
+        }
+        if (mask & (1u << j)) {
+            words += CHANNEL_WORDS;
+        }
+    }
+    return words;
+}
+
+void run_model(struct Harness_Batch * b) {
+    for (int n = 0; n < b->num_packets; n++) {
+        memcpy(&data_packet, &b->packets[n], sizeof(data_packet));
+        double t0 = seconds_now();
+        ped_subtract();
+        for (int w = 0; w < NUM_WINDOWS; w++) {
+            integral(harness.bounds[2*w], harness.bounds[2*w+1], w);
+        }
+        zero_suppress();
+        harness.seconds[BACKEND_MODEL] += seconds_now() - t0;
+        unpack_record(sparse_record, harness.results[BACKEND_MODEL][n]);
+    }
+}
+
+void run_channel_major(struct Harness_Batch * b) {
+    int32_t (*results)[CHANNEL_WORDS][NUM_CHANNELS] = harness.results[BACKEND_CHANNEL_MAJOR];
+    double t0 = seconds_now();
+    for (int n = 0; n < b->num_packets; n++) {
+        cm_ped_subtract(&b->cm_packets[n], harness.cm_peds, harness.cm_ped_sub_results);
+        cm_integrals(&b->cm_packets[n], harness.cm_ped_sub_results, harness.bounds, results[n], results[n] + NUM_WINDOWS);
+    }
+    harness.seconds[BACKEND_CHANNEL_MAJOR] += seconds_now() - t0;
+}
+
+void run_kernel(struct Harness_Batch * b, int backend) {
+    double t0 = seconds_now();
+    if (backend == BACKEND_KERNEL) {
+        preprocess_batch<Default_Config>(b->packets, b->num_packets, harness.ped_tables, 0, harness.bounds, harness.keep_all,
+                                         harness.kernel_output);
+    }
+    else {
+        preprocess_batch_parallel<Default_Config>(b->packets, b->num_packets, harness.ped_tables, 0, harness.bounds, harness.keep_all,
+                                                  harness.kernel_output);
+    }
+    harness.seconds[backend] += seconds_now() - t0;
+    const int32_t * record = harness.kernel_output + OUTPUT_HEADER_WORDS;
+    for (int n = 0; n < b->num_packets; n++) {
+        record = unpack_record(record, harness.results[backend][n]);
+    }
+}
+
+// A window's bounds after the one-time wrap by wrap samples
+void wrapped_window(const struct SW_Data_Packet * packet, int rel_start, int rel_end, int wrap, int * start, int * end) {
+    *start = packet->fine_time + rel_start - packet->starting_sample_number;
+    if (*start < 0) {
+        *start += wrap;
+    }
+    *end = packet->fine_time + rel_end - packet->starting_sample_number;
+    if (*end >= wrap) {
+        *end -= wrap;
+    }
+}
+
+// The model wraps by samples_to_be_read and reads start..end, or start..N-1
+// and 0..end, so it stays inside its array exactly when 0 <= start and
+// end < N, and inside the samples read when the last of those is at most
+// samples_to_be_read. The kernel wraps by NUM_SAMPLES-1 and agrees where
+// the bounds come out the same.
+int window_checks(const struct SW_Data_Packet * packet) {
+    int checks = 0;
+    for (int w = 0; w < NUM_WINDOWS; w++) {
+        int start, end, kernel_start, kernel_end;
+        wrapped_window(packet, harness.bounds[2*w], harness.bounds[2*w+1], packet->samples_to_be_read, &start, &end);
+        wrapped_window(packet, harness.bounds[2*w], harness.bounds[2*w+1], NUM_SAMPLES - 1, &kernel_start, &kernel_end);
+        checks |= (start < 0) ? OVERRUN_START : 0;
+        checks |= (end >= NUM_SAMPLES) ? OVERRUN_END : 0;
+        checks |= (((end >= start) ? end : NUM_SAMPLES - 1) > packet->samples_to_be_read) ? UNREAD : 0;
+        checks |= (start != kernel_start || end != kernel_end) ? KERNEL_BOUNDS : 0;
+    }
+    return checks;
+}
+
+// Keeps the first differing word of an event
+void record_mismatch(struct Mismatch * mismatch, uint64_t event, const struct SW_Data_Packet * packet,
+                     const int32_t expected[CHANNEL_WORDS][NUM_CHANNELS], const int32_t got[CHANNEL_WORDS][NUM_CHANNELS]) {
+    mismatch->event = event;
+    memcpy(&mismatch->header, packet, offsetof(struct SW_Data_Packet, samples));
+    for (int i = 0; i < CHANNEL_WORDS; i++) {
+        for (int j = 0; j < NUM_CHANNELS; j++) {
+            if (expected[i][j] != got[i][j]) {
+                mismatch->word = i;
+                mismatch->channel = j;
+                mismatch->expected = expected[i][j];
+                mismatch->got = got[i][j];
+                return;
+            }
+        }
+    }
+}
+
+// Runs a batch through every backend and compares each with the model
+void check_batch(struct Harness_Batch * b) {
+    // Drop the overruns before anything runs
+    int num_run = 0;
+    for (int n = 0; n < b->num_packets; n++) {
+        int checks = window_checks(&b->packets[n]);
+        harness.num_overrun_start += (checks & OVERRUN_START) != 0;
+        harness.num_overrun_end += (checks & OVERRUN_END) != 0;
+        if (checks & (OVERRUN_START | OVERRUN_END)) {
+            continue;
+        }
+        harness.num_unread += (checks & UNREAD) != 0;
+        harness.num_kernel_bounds += (checks & KERNEL_BOUNDS) != 0;
+        if (num_run != n) {
+            b->packets[num_run] = b->packets[n];
+            b->cm_packets[num_run] = b->cm_packets[n];
+        }
+        b->events[num_run] = harness.num_events + n;
+        b->checks[num_run] = checks;
+        num_run++;
+    }
+    harness.num_events += b->num_packets;
+    harness.num_run += num_run;
+    b->num_packets = num_run;
+    if (num_run == 0) {
+        return;
+    }
+
+    run_model(b);
+    run_channel_major(b);
+    run_kernel(b, BACKEND_KERNEL);
+    run_kernel(b, BACKEND_KERNEL_ROWS);
+
+    for (int n = 0; n < b->num_packets; n++) {
+        uint64_t event = b->events[n];
+        const int32_t (*expected)[NUM_CHANNELS] = harness.results[BACKEND_MODEL][n];
+        for (int backend = 1; backend < NUM_BACKENDS; backend++) {
+            const int32_t (*got)[NUM_CHANNELS] = harness.results[backend][n];
+            if (memcmp(expected, got, sizeof(harness.results[backend][n])) == 0) {
+                continue;
+            }
+            int drift = harness.allow_known_drift && backend != BACKEND_CHANNEL_MAJOR && (b->checks[n] & KERNEL_BOUNDS);
+            uint64_t * count = drift ? &harness.num_drifted[backend] : &harness.num_mismatched[backend];
+            if ((*count)++ == 0) {
+                record_mismatch(drift ? &harness.first_drift[backend] : &harness.first_mismatch[backend], event, &b->packets[n],
+                                expected, got);
+            }
+        }
+    }
+    b->num_packets = 0;
+}
+
+// All the rows, the zeros past samples_to_be_read too, in channel-major order
+void transpose_packet(const struct SW_Data_Packet * packet, struct Channel_Major_Packet * cm_packet) {
+    memcpy(cm_packet, packet, offsetof(struct SW_Data_Packet, samples));
+    for (int i = 0; i < NUM_SAMPLES; i++) {
+        for (int j = 0; j < NUM_CHANNELS; j++) {
+            cm_packet->samples[j][i] = packet->samples[i][j];
+        }
+    }
+    cm_packet->omega = packet->omega;
+}
+
+int check_run_file(const char * run_file) {
+    int run_fd = open(run_file, O_RDONLY);
+    if (run_fd == -1) {
+        perror("open");
+        return -1;
+    }
+    struct Buffer_Pool arena;
+    if (buffer_pool_init(&arena, FRAME_STREAM_BYTES, 1) != 0) {
+        close(run_fd);
+        return -1;
+    }
+    struct Frame_Stream stream;
+    frame_stream_init(&stream, run_fd, (uint8_t *) buffer_pool_slot(&arena, buffer_pool_acquire(&arena)));
+    long frame_bytes;
+    const uint8_t * frame;
+    while ((frame = frame_stream_next(&stream, &frame_bytes)) != NULL) {
+        frame_decode(frame, &batch.packets[batch.num_packets]);
+        frame_decode_channel_major(frame, &batch.cm_packets[batch.num_packets]);
+        if (++batch.num_packets == HARNESS_BATCH_PACKETS) {
+            check_batch(&batch);
+        }
+    }
+    if (batch.num_packets > 0) {
+        check_batch(&batch);
+    }
+    printf("%s: %lu packets, %lu bad frames\n", run_file, (unsigned long) stream.stats.num_frames, (unsigned long) stream.stats.num_bad);
+    buffer_pool_destroy(&arena);
+    close(run_fd);
+    return 0;
+}
+
+uint64_t next_random(uint64_t * state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ Packets around the loaded pedestals: noise of a few counts, and on some
+ channels a pulse near the trigger sample. Banks, starting cells, trigger
+ samples and read lengths, from min_read + 1 to NUM_SAMPLES samples, are
+ uniform, so windows wrap around the storage cells and the waveform end.
+*/
+void generate_packet(uint64_t * rng, uint64_t event, int min_read, struct SW_Data_Packet * packet) {
+    memset(packet, 0, sizeof(*packet));
+    packet->alpha = 0xA1FA;
+    packet->i2c_address = next_random(rng) & 0x7;
+    packet->conf_address = next_random(rng) & 0xf;
+    packet->bank = next_random(rng) & 1;
+    packet->fine_time = next_random(rng) & 0xff;
+    packet->coarse_time = (uint32_t) event;
+    packet->trigger_number = (uint16_t) event;
+    packet->samples_after_trigger = 250;
+    packet->look_back_samples = 5;
+    packet->samples_to_be_read = min_read + next_random(rng) % (NUM_SAMPLES - min_read);
+    packet->starting_sample_number = next_random(rng) & 0xff;
+    packet->omega = 0x0E6A;
+
+    int trigger = (packet->fine_time - packet->starting_sample_number) & (NUM_SAMPLES - 1);
+    uint32_t pulsed = next_random(rng) & 0xffff;
+    int amplitude = 50 + next_random(rng) % 1500;
+    int cell = packet->starting_sample_number;
+    for (int i = 0; i < packet->samples_to_be_read + 1; i++) {
+        int from_trigger = i - trigger;
+        int pulse = 0;
+        if (from_trigger >= 0 && from_trigger < 24) {
+            // Fast rise, slow fall
+            pulse = (from_trigger < 3) ? amplitude * (from_trigger + 1) / 3 : amplitude * 3 / from_trigger;
+        }
+        for (int j = 0; j < NUM_CHANNELS; j++) {
+            int noise = (int) (next_random(rng) % 17) - 8;
+            int value = all_peds[packet->bank][cell][j] + noise + ((pulsed >> j) & 1) * pulse;
+            packet->samples[i][j] = (value < 0) ? 0 : (value > 0xfff) ? 0xfff : value;
+        }
+        cell = (cell + 1) % NUM_SAMPLES;
+    }
+}
+
+void check_generated(uint64_t num_packets, uint64_t seed, int min_read) {
+    uint64_t rng = seed ? seed : 1;
+    for (uint64_t e = 0; e < num_packets; e++) {
+        generate_packet(&rng, e, min_read, &batch.packets[batch.num_packets]);
+        transpose_packet(&batch.packets[batch.num_packets], &batch.cm_packets[batch.num_packets]);
+        if (++batch.num_packets == HARNESS_BATCH_PACKETS) {
+            check_batch(&batch);
+        }
+    }
+    if (batch.num_packets > 0) {
+        check_batch(&batch);
+    }
+    printf("generated: %lu packets, seed %lu, samples_to_be_read %d to %d\n", (unsigned long) num_packets,
+           (unsigned long) seed, min_read, NUM_SAMPLES - 1);
+}
+
+void print_mismatch(int backend, const struct Mismatch * mismatch, const char * what) {
+    const char * feature_names[NUM_FEATURES] = {"peak", "peak_time", "cfd_time"};
+    const struct SW_Data_Packet * header = &mismatch->header;
+    printf("%s: first %s at event %lu (trigger_number %d, bank %d, fine_time %d, starting_sample_number %d, samples_to_be_read %d), ",
+           backend_names[backend], what, (unsigned long) mismatch->event, header->trigger_number, header->bank, header->fine_time,
+           header->starting_sample_number, header->samples_to_be_read);
+    if (mismatch->word < NUM_WINDOWS) {
+        printf("window %d (%d,%d)", mismatch->word, harness.bounds[2*mismatch->word], harness.bounds[2*mismatch->word+1]);
+    }
+    else {
+        printf("%s", feature_names[mismatch->word - NUM_WINDOWS]);
+    }
+    printf(", channel %d: model %d, %s %d\n", mismatch->channel, mismatch->expected, backend_names[backend], mismatch->got);
+}
+
+int main(int argc, char *argv[]){
+
+    const char * program = argv[0];
+    if (argc > 1 && strcmp(argv[1], "--allow-known-drift") == 0) {
+        harness.allow_known_drift = 1;
+        argc--;
+        argv++;
+    }
+    int first_corpus = 2 + 2*NUM_WINDOWS;
+    if (argc <= first_corpus) {
+        printf("Usage: %s [--allow-known-drift] <peds_file> <s1> <e1> <s2> <e2> <s3> <e3> <s4> <e4> <corpus>...\n", program);
+        printf("       corpus: a run file, or --generate <packets> <seed> <min_samples_to_be_read>\n");
+        printf("       Runs the corpus through the C model, the channel-major CPU kernels and the HLS\n");
+        printf("       kernel in both variants, reports where each first differs from the model and\n");
+        printf("       each one's events/s. Returns 0 if they all agree. --allow-known-drift lets the\n");
+        printf("       kernels differ where they wrap a window differently from the model.\n");
+        return -1;
+    }
+    if (read_peds_file(argv[1]) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < 2*NUM_WINDOWS; i++) {
+        harness.bounds[i] = atoi(argv[2 + i]);
+    }
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        harness.keep_all[j] = INT32_MIN;
+        thresholds[j] = INT32_MIN;
+    }
+    memcpy(harness.ped_tables, all_peds, sizeof(all_peds));
+    cm_transpose_peds(&all_peds[0][0][0], harness.cm_peds);
+
+    for (int a = first_corpus; a < argc; a++) {
+        if (strcmp(argv[a], "--generate") == 0) {
+            if (a + 3 >= argc) {
+                printf("--generate takes <packets> <seed> <min_samples_to_be_read>.\n");
+                return -1;
+            }
+            int min_read = atoi(argv[a + 3]);
+            min_read = (min_read < 0) ? 0 : (min_read > NUM_SAMPLES - 1) ? NUM_SAMPLES - 1 : min_read;
+            check_generated(strtoull(argv[a + 1], NULL, 10), strtoull(argv[a + 2], NULL, 10), min_read);
+            a += 3;
+        }
+        else if (check_run_file(argv[a]) != 0) {
+            return -1;
+        }
+    }
+
+    printf("%lu events, %lu compared, %lu not run (a model window starts before sample 0 in %lu, ends past the last sample in %lu)\n",
+           (unsigned long) harness.num_events, (unsigned long) harness.num_run, (unsigned long) (harness.num_events - harness.num_run),
+           (unsigned long) harness.num_overrun_start, (unsigned long) harness.num_overrun_end);
+    printf("Of those compared, %lu have a window past samples_to_be_read, %lu one the kernel wraps by %d samples where the model "
+           "wraps by samples_to_be_read\n",
+           (unsigned long) harness.num_unread, (unsigned long) harness.num_kernel_bounds, NUM_SAMPLES - 1);
+    printf("%-14s %12s %10s %12s %12s\n", "backend", "events/s", "us/event", "differ", "known drift");
+    for (int backend = 0; backend < NUM_BACKENDS; backend++) {
+        double seconds = harness.seconds[backend];
+        printf("%-14s %12.0f %10.3f ", backend_names[backend], seconds > 0 ? harness.num_run / seconds : 0.0,
+               harness.num_run ? seconds * 1e6 / harness.num_run : 0.0);
+        if (backend == BACKEND_MODEL) {
+            printf("%12s\n", "reference");
+        }
+        else {
+            printf("%12lu %12lu\n", (unsigned long) harness.num_mismatched[backend], (unsigned long) harness.num_drifted[backend]);
+        }
+    }
+    int num_differing = 0;
+    for (int backend = 1; backend < NUM_BACKENDS; backend++) {
+        if (harness.num_mismatched[backend] > 0) {
+            print_mismatch(backend, &harness.first_mismatch[backend], "differs");
+            num_differing++;
+        }
+        if (harness.num_drifted[backend] > 0) {
+            print_mismatch(backend, &harness.first_drift[backend], "known drift");
+        }
+    }
+    return (num_differing == 0) ? 0 : -2;
+}
@@ -0,0 +1,184 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "preprocess.h"
+#include "integral_archive.h"
+#include "event_builder.h"
+
+void print_asics(const char * name, const uint32_t * mask) {
+    printf("%s:", name);
+    for (int id = 0; id < EB_MAX_ASICS; id++) {
+        if (eb_test(mask, id)) {
+            printf(" %d:%d", id >> 4, id & 0xf);
+        }
+    }
+    printf("\n");
+}
+
+struct Builder_Output {
+    uint64_t event_number;
+    int check; // --check: verify every built event, see check_built_event
+    uint64_t coincidence_window;
+    uint64_t num_bad; // Events that break the builder's rules
+    uint64_t num_spread; // Events whose contributors' coarse times differ
+};
+
+/*
+ Every contributor must have the event's trigger number and a coarse time
+ no earlier than the one before it (heap order) and within the
+ coincidence window of the first, and each ASIC may contribute once.
+ Coarse times are compared as 32-bit differences, so they may roll over.
+*/
+void check_built_event(const struct Built_Event * built, struct Builder_Output * output) {
+    const struct Archive_Event * leader = built->contributors[0];
+    uint32_t seen[EB_MASK_WORDS];
+    memset(seen, 0, sizeof(seen));
+    uint32_t previous = 0;
+    int bad = 0;
+    for (int i = 0; i < built->num_contributors; i++) {
+        const struct Archive_Event * event = built->contributors[i];
+        uint32_t offset = event->coarse_time - leader->coarse_time;
+        int id = eb_asic_id(event);
+        if (event->trigger_number != (uint16_t) built->trigger || offset > output->coincidence_window ||
+            offset < previous || eb_test(seen, id)) {
+            bad = 1;
+        }
+        eb_set(seen, id);
+        previous = offset;
+    }
+    if (bad) {
+        if (output->num_bad == 0) {
+            printf("Event %lu (trigger %lu, coarse_time %lu) breaks the coincidence rules.\n", (unsigned long) output->event_number,
+                   (unsigned long) built->trigger, (unsigned long) built->coarse);
+        }
+        output->num_bad++;
+    }
+    output->num_spread += (previous != 0);
+}
+
+// Prints one built event, one line per contributing ASIC
+void print_built_event(const struct Built_Event * built, void * user) {
+    struct Builder_Output * output = (struct Builder_Output *) user;
+    if (output->check) {
+        check_built_event(built, output);
+    }
+    printf("event: %lu\n", (unsigned long) output->event_number++);
+    printf("trigger_number: %lu\n", (unsigned long) built->trigger);
+    printf("coarse_time: %lu\n", (unsigned long) built->coarse);
+    printf("contributors: %d\n", built->num_contributors);
+    for (int i = 0; i < built->num_contributors; i++) {
+        const struct Archive_Event * event = built->contributors[i];
+        printf("  %d:%d bank %d fine_time %d coarse_time %u channel_mask %d\n", event->i2c_address, event->conf_address,
+               event->bank, event->fine_time, event->coarse_time, event->record[0]);
+    }
+    print_asics("missed", built->missed);
+    print_asics("absent", built->absent);
+}
+
+// With --summary only the builder's own counters are reported
+void count_built_event(const struct Built_Event * built, void * user) {
+    struct Builder_Output * output = (struct Builder_Output *) user;
+    if (output->check) {
+        check_built_event(built, output);
+    }
+    output->event_number++;
+}
+
+int main(int argc, char *argv[]){
+
+    struct Builder_Output output;
+    memset(&output, 0, sizeof(output));
+    int summary_only = 0;
+    int first_arg = 1;
+    for (; first_arg < argc; first_arg++) {
+        if (strcmp(argv[first_arg], "--summary") == 0) {
+            summary_only = 1;
+        }
+        else if (strcmp(argv[first_arg], "--check") == 0) {
+            output.check = 1;
+        }
+        else {
+            break;
+        }
+    }
+    if (argc < first_arg + 2) {
+        printf("Usage: %s [--summary] [--check] <coincidence_window> <archive_file>...\n", argv[0]);
+        printf("       Builds events across ASICs from integral archives, matching trigger_number\n");
+        printf("       and coarse_time within coincidence_window ticks. Archives are read in turn,\n");
+        printf("       one event at a time, like separate streams.\n");
+        printf("       --check verifies every built event against those rules and returns -2 if any\n");
+        printf("       breaks them.\n");
+        return -1;
+    }
+    uint64_t coincidence_window = strtoull(argv[first_arg], NULL, 10);
+    output.coincidence_window = coincidence_window;
+    int num_archives = argc - first_arg - 1;
+
+    struct Archive_Reader * readers = (struct Archive_Reader *) malloc(sizeof(struct Archive_Reader) * num_archives);
+    uint64_t * next_event = (uint64_t *) calloc(num_archives, sizeof(uint64_t));
+    for (int a = 0; a < num_archives; a++) {
+        int archive_fd = open(argv[first_arg + 1 + a], O_RDONLY);
+        if (archive_fd == -1) {
+            perror("open");
+            return -1;
+        }
+        if (archive_reader_open(&readers[a], archive_fd) != 0) {
+            return -1;
+        }
+    }
+
+    static struct Event_Builder eb;
+    event_builder_init(&eb, coincidence_window, EB_DEFAULT_QUEUE_PACKETS);
+    Built_Event_Callback callback = summary_only ? count_built_event : print_built_event;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct Archive_Event event;
+    int num_open = num_archives;
+    while (num_open > 0) {
+        num_open = 0;
+        for (int a = 0; a < num_archives; a++) {
+            if (next_event[a] == archive_num_events(&readers[a])) {
+                continue;
+            }
+            if (archive_read_event(&readers[a], next_event[a], &event) != 0) {
+                printf("%s is corrupt at event %lu.\n", argv[first_arg + 1 + a], (unsigned long) next_event[a]);
+                return -2;
+            }
+            next_event[a]++;
+            num_open++;
+            if (event_builder_push(&eb, &event, callback, &output) != 0) {
+                return -1;
+            }
+        }
+    }
+    event_builder_flush(&eb, callback, &output);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    fprintf(stderr, "INFO: %lu packets from %d ASICs into %lu events in %.3f s (%.0f packets/s)\n",
+            (unsigned long) eb.num_packets, eb.num_expected, (unsigned long) eb.num_events, elapsed,
+            elapsed > 0 ? eb.num_packets / elapsed : 0.0);
+    fprintf(stderr, "INFO: %lu incomplete events, %lu ASICs missed a trigger, %lu absent, %lu events built early on a full queue\n",
+            (unsigned long) eb.num_incomplete, (unsigned long) eb.num_missed, (unsigned long) eb.num_absent,
+            (unsigned long) eb.num_forced);
+
+    if (output.check) {
+        fprintf(stderr, "INFO: check  %lu events break the coincidence rules, %lu built from differing coarse times\n",
+                (unsigned long) output.num_bad, (unsigned long) output.num_spread);
+    }
+
+    event_builder_destroy(&eb);
+    for (int a = 0; a < num_archives; a++) {
+        close(readers[a].fd);
+        archive_reader_close(&readers[a]);
+    }
+    free(readers);
+    free(next_event);
+    return (output.num_bad == 0) ? 0 : -2;
+}
@@ -0,0 +1,298 @@
+#ifndef EVENT_BUILDER_H
+#define EVENT_BUILDER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "preprocess.h"
+#include "integral_archive.h"
+
+/*
+ Groups per-ASIC results into physics events. Packets are queued per ASIC
+ (i2c_address, conf_address), each queue in that ASIC's time order, and a
+ binary min-heap over the queue heads, keyed by (trigger_number,
+ coarse_time), merges them k ways. An event is the smallest head plus
+ every other head with the same trigger number and a coarse time within
+ the coincidence window of it, at most one packet per ASIC.
+
+ Trigger number (16 bits) and coarse time (32 bits) are unwrapped per ASIC
+ into 64-bit keys, so they can roll over mid-run.
+
+ Every ASIC seen so far is expected in every event. Nothing is built
+ until queue_packets packets have come in, so the ASICs of a run are all
+ known before the first event. An expected ASIC that is not in an event
+ is flagged as missed if its number_of_missed_triggers went up by its
+ next packet (it was busy and dropped the trigger), and as absent
+ otherwise.
+
+ Memory is bounded: an event is only built when every expected ASIC has a
+ packet queued (so the heap top is the true minimum), or when some queue
+ is full, in which case ASICs with nothing queued count as not in the
+ event. event_builder_flush builds whatever is left at the end of a run.
+*/
+#define EB_MAX_ASICS 128 // 3-bit i2c address, 4-bit conf address
+#define EB_MASK_WORDS (EB_MAX_ASICS / 32)
+#define EB_DEFAULT_QUEUE_PACKETS 256 // Per ASIC
+
+struct Eb_Packet {
+    uint64_t trigger; // Unwrapped trigger_number
+    uint64_t coarse; // Unwrapped coarse_time
+    struct Archive_Event event;
+};
+
+struct Eb_Queue {
+    struct Eb_Packet * packets; // Ring, allocated when the ASIC is first seen
+    int head;
+    int count;
+    // Unwrap state, from the last packet pushed
+    uint16_t last_trigger;
+    uint32_t last_coarse;
+    uint64_t trigger;
+    uint64_t coarse;
+    uint8_t last_missed; // number_of_missed_triggers of the last packet built into an event
+};
+
+// One built event. The contributor pointers stay valid until the callback returns.
+struct Built_Event {
+    uint64_t trigger;
+    uint64_t coarse;
+    int num_contributors;
+    const struct Archive_Event * contributors[EB_MAX_ASICS]; // In heap order, earliest coarse time first
+    uint32_t present[EB_MASK_WORDS]; // Bit per ASIC id
+    uint32_t missed[EB_MASK_WORDS]; // Expected, not present, and its missed-trigger count went up
+    uint32_t absent[EB_MASK_WORDS]; // Expected, not present, no missed trigger reported
+};
+
+typedef void (*Built_Event_Callback)(const struct Built_Event * built, void * user);
+
+struct Event_Builder {
+    uint64_t coincidence_window; // In coarse_time ticks
+    int queue_packets;
+    struct Eb_Queue queues[EB_MAX_ASICS];
+    uint32_t expected[EB_MASK_WORDS];
+    int num_expected;
+    int num_waiting; // Expected ASICs with an empty queue
+    int num_full; // Queues at capacity
+    int started; // Past the first queue_packets packets
+    int heap[EB_MAX_ASICS]; // ASIC ids with a packet queued, min-heap on their head's key
+    int heap_size;
+    struct Built_Event built;
+    // Statistics
+    uint64_t num_packets;
+    uint64_t num_events;
+    uint64_t num_incomplete; // Events with any expected ASIC missing
+    uint64_t num_missed; // ASIC-events flagged missed
+    uint64_t num_absent; // ASIC-events flagged absent
+    uint64_t num_forced; // Events built early because a queue was full
+};
+
+static inline int eb_asic_id(const struct Archive_Event * event) {
+    return ((event->i2c_address & 0x7) << 4) | (event->conf_address & 0xf);
+}
+
+static inline int eb_test(const uint32_t * mask, int id) {
+    return (mask[id >> 5] >> (id & 31)) & 1;
+}
+
+static inline void eb_set(uint32_t * mask, int id) {
+    mask[id >> 5] |= 1u << (id & 31);
+}
+
+static inline struct Eb_Packet * eb_queue_head(struct Eb_Queue * queue) {
+    return &queue->packets[queue->head];
+}
+
+static inline int eb_key_less(struct Event_Builder * eb, int a, int b) {
+    const struct Eb_Packet * pa = eb_queue_head(&eb->queues[a]);
+    const struct Eb_Packet * pb = eb_queue_head(&eb->queues[b]);
+    if (pa->trigger != pb->trigger) {
+        return pa->trigger < pb->trigger;
+    }
+    return pa->coarse < pb->coarse;
+}
+
+static inline void eb_sift_up(struct Event_Builder * eb, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!eb_key_less(eb, eb->heap[i], eb->heap[parent])) {
+            break;
+        }
+        int tmp = eb->heap[i];
+        eb->heap[i] = eb->heap[parent];
+        eb->heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+static inline void eb_sift_down(struct Event_Builder * eb, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2*i + 1;
+        int right = left + 1;
+        if (left < eb->heap_size && eb_key_less(eb, eb->heap[left], eb->heap[smallest])) {
+            smallest = left;
+        }
+        if (right < eb->heap_size && eb_key_less(eb, eb->heap[right], eb->heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        int tmp = eb->heap[i];
+        eb->heap[i] = eb->heap[smallest];
+        eb->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static inline void event_builder_init(struct Event_Builder * eb, uint64_t coincidence_window, int queue_packets) {
+    memset(eb, 0, sizeof(*eb));
+    eb->coincidence_window = coincidence_window;
+    eb->queue_packets = queue_packets;
+}
+
+static inline void event_builder_destroy(struct Event_Builder * eb) {
+    for (int id = 0; id < EB_MAX_ASICS; id++) {
+        free(eb->queues[id].packets);
+        eb->queues[id].packets = NULL;
+    }
+}
+
+// Pops the top ASIC's head packet and restores the heap
+static inline struct Eb_Packet * eb_pop_top(struct Event_Builder * eb) {
+    int id = eb->heap[0];
+    struct Eb_Queue * queue = &eb->queues[id];
+    struct Eb_Packet * packet = eb_queue_head(queue);
+    if (queue->count == eb->queue_packets) {
+        eb->num_full--;
+    }
+    queue->head = (queue->head + 1) % eb->queue_packets;
+    queue->count--;
+    queue->last_missed = packet->event.number_of_missed_triggers;
+    if (queue->count > 0) {
+        eb_sift_down(eb, 0);
+    }
+    else {
+        eb->heap_size--;
+        eb->heap[0] = eb->heap[eb->heap_size];
+        eb_sift_down(eb, 0);
+        eb->num_waiting++;
+    }
+    return packet;
+}
+
+// Builds one event from the heap top. The heap must not be empty.
+static inline void eb_build_one(struct Event_Builder * eb, Built_Event_Callback callback, void * user) {
+    struct Built_Event * built = &eb->built;
+    memset(built->present, 0, sizeof(built->present));
+    memset(built->missed, 0, sizeof(built->missed));
+    memset(built->absent, 0, sizeof(built->absent));
+    built->num_contributors = 0;
+
+    struct Eb_Packet * leader = eb_pop_top(eb);
+    built->trigger = leader->trigger;
+    built->coarse = leader->coarse;
+    built->contributors[built->num_contributors++] = &leader->event;
+    eb_set(built->present, eb_asic_id(&leader->event));
+    while (eb->heap_size > 0) {
+        int id = eb->heap[0];
+        struct Eb_Packet * next = eb_queue_head(&eb->queues[id]);
+        if (next->trigger != built->trigger || next->coarse - built->coarse > eb->coincidence_window ||
+            eb_test(built->present, id)) {
+            break;
+        }
+        eb_pop_top(eb);
+        built->contributors[built->num_contributors++] = &next->event;
+        eb_set(built->present, id);
+    }
+
+    if (built->num_contributors < eb->num_expected) {
+        for (int id = 0; id < EB_MAX_ASICS; id++) {
+            if (!eb_test(eb->expected, id) || eb_test(built->present, id)) {
+                continue;
+            }
+            struct Eb_Queue * queue = &eb->queues[id];
+            if (queue->count > 0 && eb_queue_head(queue)->event.number_of_missed_triggers != queue->last_missed) {
+                eb_set(built->missed, id);
+                eb->num_missed++;
+            }
+            else {
+                eb_set(built->absent, id);
+                eb->num_absent++;
+            }
+        }
+        eb->num_incomplete++;
+    }
+    eb->num_events++;
+    callback(built, user);
+}
+
+// Builds every event that can be built without waiting on an ASIC
+static inline void event_builder_poll(struct Event_Builder * eb, Built_Event_Callback callback, void * user) {
+    while (eb->heap_size > 0 && ((eb->started && eb->num_waiting == 0) || eb->num_full > 0)) {
+        if (eb->num_waiting > 0) {
+            eb->num_forced++;
+        }
+        eb_build_one(eb, callback, user);
+    }
+}
+
+// Builds everything still queued, at the end of a run
+static inline void event_builder_flush(struct Event_Builder * eb, Built_Event_Callback callback, void * user) {
+    while (eb->heap_size > 0) {
+        eb_build_one(eb, callback, user);
+    }
+}
+
+// Queues one packet and builds the events it completes. Returns -1 if out of memory.
+static inline int event_builder_push(struct Event_Builder * eb, const struct Archive_Event * event,
+                                     Built_Event_Callback callback, void * user) {
+    int id = eb_asic_id(event);
+    struct Eb_Queue * queue = &eb->queues[id];
+    if (!eb_test(eb->expected, id)) {
+        queue->packets = (struct Eb_Packet *) malloc(sizeof(struct Eb_Packet) * eb->queue_packets);
+        if (queue->packets == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        queue->trigger = event->trigger_number;
+        queue->coarse = event->coarse_time;
+        queue->last_missed = event->number_of_missed_triggers;
+        eb_set(eb->expected, id);
+        eb->num_expected++;
+        eb->num_waiting++;
+    }
+    else {
+        queue->trigger += (int16_t) (uint16_t) (event->trigger_number - queue->last_trigger);
+        queue->coarse += (int32_t) (event->coarse_time - queue->last_coarse);
+    }
+    queue->last_trigger = event->trigger_number;
+    queue->last_coarse = event->coarse_time;
+
+    // Make room by building, a full queue forces the oldest event out
+    while (queue->count == eb->queue_packets) {
+        event_builder_poll(eb, callback, user);
+    }
+
+    struct Eb_Packet * packet = &queue->packets[(queue->head + queue->count) % eb->queue_packets];
+    packet->trigger = queue->trigger;
+    packet->coarse = queue->coarse;
+    packet->event = *event;
+    queue->count++;
+    eb->num_packets++;
+    eb->started |= (eb->num_packets >= (uint64_t) eb->queue_packets);
+    if (queue->count == eb->queue_packets) {
+        eb->num_full++;
+    }
+    if (queue->count == 1) {
+        eb->num_waiting--;
+        eb->heap[eb->heap_size++] = id;
+        eb_sift_up(eb, eb->heap_size - 1);
+    }
+    event_builder_poll(eb, callback, user);
+    return 0;
+}
+
+#endif // EVENT_BUILDER_H
@@ -1,8 +1,3 @@
-// char: 8 bit, short: 16 bit, long: 32 bit
-
-#define NUM_CHANNELS 16
-#define NUM_SAMPLES 256 // N
-#define BUF_SIZE 4105 // 8 + N*16 + 1 words (16 bits / 2 bytes per word)
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -11,91 +6,28 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "preprocess.h"
+#include "buffer_pool.h"
+#include "packet_framer.h"
 
-/*
- Mimics incoming data packet in C types.
-*/
-struct SW_Data_Packet {
-    uint16_t alpha; // Start Constant 0xA1FA
-    uint8_t i2c_address; // 3 bits
-    uint8_t conf_address; // 4 bits
-    uint8_t bank; // 1 bit, A or B
-    uint8_t fine_time; // 8 bits, sample number when trigger arrives
-    uint32_t coarse_time; // 32 bits
-    uint16_t trigger_number; // 16 bits
-    uint8_t samples_after_trigger; // 8 bits
-    uint8_t look_back_samples; // 8 bits
-    uint8_t samples_to_be_read; // 8 bits
-    uint8_t starting_sample_number; // 8 bits
-    uint8_t number_of_missed_triggers; // 8 bits
-    uint8_t state_machine_status; // 8 bits
-    uint16_t samples[NUM_SAMPLES][NUM_CHANNELS]; // Variable size?
-    // Looks like N samples for 16 channels (so 1 ASIC)
-    uint16_t omega; // End Constant 0x0E6A
-};
+struct Buffer_Pool arena; // Page-aligned scratch buffers, one Frame_Stream window per slot
 
+// Decodes the first packet of the run file. Returns -1 if there is none.
 int data_packet_dat_to_struct(int fd, SW_Data_Packet * data_packet){
-
-    // Read data into a larger buffer and then strip 
-    // all of the spaces because dat files are bit-space-delineated.
-
-    // The times two is to account for the space-delineation
-    int num_bits = BUF_SIZE * 16 * 2;
-    uint8_t og_buf[num_bits];
-
-    if (read(fd, og_buf, num_bits) == -1) {
-        perror("read");
-    }
-
-    for (int i = 0; i < num_bits; i++) {
-        og_buf[i] = og_buf[i] - 0x30; // 0 in ASCII
+    int scratch_slot = buffer_pool_acquire(&arena);
+    struct Frame_Stream stream;
+    frame_stream_init(&stream, fd, (uint8_t *) buffer_pool_slot(&arena, scratch_slot));
+
+    long frame_bytes;
+    const uint8_t * frame = frame_stream_next(&stream, &frame_bytes);
+    if (frame != NULL) {
+        frame_decode(frame, data_packet);
     }
-
-    uint16_t buf[BUF_SIZE];
-    uint8_t ms_half, ls_half;
-    int base = 0;
-    for (int i = 0; i < BUF_SIZE; i++) {
-        base = i * 32;
-        ms_half = (og_buf[base] << 7) | (og_buf[base + 2] << 6) | (og_buf[base + 4] << 5) | (og_buf[base + 6] << 4) | (og_buf[base + 8] << 3) | (og_buf[base + 10] << 2) | (og_buf[base + 12] << 1) | og_buf[base + 14];
-        ls_half = (og_buf[base + 16] << 7) | (og_buf[base + 18] << 6) | (og_buf[base + 20] << 5) | (og_buf[base + 22] << 4) | (og_buf[base + 24] << 3) | (og_buf[base + 26] << 2) | (og_buf[base + 28] << 1) | og_buf[base + 30];
-        buf[i] = (ms_half << 8) | ls_half;
+    buffer_pool_release(&arena, scratch_slot);
+    if (frame == NULL) {
+        printf("No packet found in the run file.\n");
+        return -1;
     }
-
-    // First short should be 0xA1FA
-    if (buf[0] != 0xa1fa) {
-        printf("File must start with word 0xA1FA.\n");
-        return -2;
-    }
-
-    data_packet->alpha = buf[0];
-    data_packet->i2c_address = 0b111 & (buf[1] >> 13);
-    data_packet->conf_address = 0b1111 & (buf[1] >> 9);
-    data_packet->bank = 0b1 & (buf[1] >> 8);
-    data_packet->fine_time = 0xff & buf[1];
-    data_packet->coarse_time = (((uint32_t) buf[2]) << 16) & (((uint32_t) buf[3]) & 0xffff);
-    data_packet->trigger_number = buf[4];
-    data_packet->samples_after_trigger = (buf[5] >> 8) & 0xff;
-    data_packet->look_back_samples = buf[5] & 0xff;
-    data_packet->samples_to_be_read = (buf[6] >> 8) & 0xff;
-    data_packet->starting_sample_number = buf[6] & 0xff;
-    data_packet->number_of_missed_triggers = (buf[7] >> 8) & 0xff;
-    data_packet->state_machine_status = buf[7] & 0xff;
-
-    int buf_idx = 8;
-    for (int i = 0; i < data_packet->samples_to_be_read + 1; i++) {
-        for (int j = 0; j < NUM_CHANNELS; j++) {
-            data_packet->samples[i][j] = buf[buf_idx] & 0xfff;
-            buf_idx++;
-        }
-    }
-
-    // Last short should be 0x0E6A
-    if (buf[buf_idx] != 0x0e6a) {
-        printf("File must end with word 0x0E6A.\n");
-        return -3;
-    }
-    data_packet->omega = buf[buf_idx];
-
     return 0;
 }
 
@@ -160,24 +92,65 @@ int write_header(int fd, char * field, uint32_t value) {
     return 0;
 }
 
-int write_integrals(int fd, char ** bounds, int32_t *integrals) {
-    char value_ptr[10];
-    for (int i = 0; i < 4; i++) {
-        sprintf(value_ptr, "%d (%s,%s)", i, bounds[i*2], bounds[i*2+1]);
+int thresholds_dat_to_array(int fd, int32_t * thresholds) {
+    FILE * fp = fdopen(fd, "r");
+    if(fp == NULL) {
+        perror("fdopen");
+        return -1;
+    }
+
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        if (fscanf(fp, "%d", &thresholds[j]) != 1) {
+            printf("Thresholds file must hold %d values.\n", NUM_CHANNELS);
+            fclose(fp);
+            return -2;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Reads a sparse record (channel mask, then CHANNEL_WORDS per kept channel)
+// and writes only the kept channels, one line per window followed by one
+// line per pulse feature. Returns the number of words consumed.
+int write_integrals(int fd, char ** bounds, int32_t *record) {
+    char value_ptr[32];
+    const char * feature_names[NUM_FEATURES] = {"peak", "peak_time", "cfd_time"};
+    uint32_t mask = record[0];
+    int num_kept = 0;
+    for (int i = 0; i < CHANNEL_WORDS; i++) {
+        if (i < NUM_WINDOWS) {
+            sprintf(value_ptr, "%d (%s,%s)", i, bounds[i*2], bounds[i*2+1]);
+        }
+        else {
+            sprintf(value_ptr, "%s", feature_names[i-NUM_WINDOWS]);
+        }
         write(fd, value_ptr, strlen(value_ptr));
         write(fd, "   ", 3);
+        num_kept = 0;
         for (int j = 0; j < NUM_CHANNELS; j++) {
-            //sprintf(value_ptr, "%d", integrals[i][j]);
-            sprintf(value_ptr, "%d", *(integrals+i*NUM_CHANNELS+j));
-            write(fd, " ", 1);
-            write(fd, value_ptr, strlen(value_ptr));
+            if (mask & (1 << j)) {
+                int32_t value = record[1 + num_kept*CHANNEL_WORDS + i];
+                if (i == CHANNEL_WORDS-1 && value == CFD_NO_CROSSING) {
+                    sprintf(value_ptr, "-");
+                }
+                else if (i == CHANNEL_WORDS-1) {
+                    sprintf(value_ptr, "%.2f", (double) value / (1 << CFD_TIME_SHIFT));
+                }
+                else {
+                    sprintf(value_ptr, "%d", value);
+                }
+                write(fd, " ", 1);
+                write(fd, value_ptr, strlen(value_ptr));
+                num_kept++;
+            }
         }
         write(fd, "\n", 1);
     }
-    return 0;
+    return 1 + num_kept*CHANNEL_WORDS;
 }
 
-int write_output(int fd, char ** bounds, int32_t *integrals, SW_Data_Packet * data_packet) {
+int write_output(int fd, char ** bounds, int32_t *record, SW_Data_Packet * data_packet) {
     write_header(fd, "i2c_address", data_packet->i2c_address);
     write_header(fd, "conf_address", data_packet->conf_address);
     write_header(fd, "bank", data_packet->bank);
@@ -190,17 +163,19 @@ int write_output(int fd, char ** bounds, int32_t *integrals, SW_Data_Packet * da
     write_header(fd, "starting_sample_number", data_packet->starting_sample_number);
     write_header(fd, "number_of_missed_triggers", data_packet->number_of_missed_triggers);
     write_header(fd, "state_machine_status", data_packet->state_machine_status);
-    write_integrals(fd, bounds, integrals);
-    return 0;
+    write_header(fd, "channel_mask", record[0]);
+    return write_integrals(fd, bounds, record);
 }
 
-int produce_output(char ** bounds, int32_t *integrals, SW_Data_Packet * data_packet) {
+int produce_output(char ** bounds, int32_t *record, SW_Data_Packet * data_packet) {
     int output_fd = open("output.txt", O_CREAT | O_RDWR, 0666);
     if (output_fd == -1) {
         perror("open");
     }
 
-    write_output(output_fd, bounds, integrals, data_packet);
+    write_output(output_fd, bounds, record, data_packet);
+    close(output_fd);
+    return 0;
 }
 
 // ------------------------------------------------------------------------------------
@@ -209,12 +184,17 @@ int produce_output(char ** bounds, int32_t *integrals, SW_Data_Packet * data_pac
 int main(int argc, char **argv)
 {
     struct SW_Data_Packet input_data_packet;
-    uint16_t input_all_peds[2][NUM_SAMPLES][NUM_CHANNELS];
+    uint16_t input_ped_tables[2][2][NUM_SAMPLES][NUM_CHANNELS]; // Two generations, only slot 0 used here
     int bounds[8];
-    int32_t output_integrals[4][NUM_CHANNELS];
+    int32_t thresholds[NUM_CHANNELS];
+    int32_t output_integrals[OUTPUT_HEADER_WORDS + SPARSE_RECORD_MAX_WORDS];
+
+    if (buffer_pool_init(&arena, FRAME_STREAM_BYTES, 1) != 0) {
+        return -1;
+    }
 
     // Initialize the data used in the test
-    initialize_inputs(&input_data_packet, input_all_peds);
+    initialize_inputs(&input_data_packet, &input_ped_tables[0][0][0][0]);
 
     char * bounds_strings[8] = {"-5", "5", "-10", "10", "-15", "15", "-20", "20"};
     bounds[0] = atoi(bounds_strings[0]);
@@ -226,7 +206,11 @@ int main(int argc, char **argv)
     bounds[6] = atoi(bounds_strings[6]);
     bounds[7] = atoi(bounds_strings[7]);
 
-    preprocess(&input_data_packet, input_all_peds, bounds, output_integrals);
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        thresholds[j] = INT32_MIN; // Keep every channel
+    }
+
+    preprocess(&input_data_packet, 1, &input_ped_tables[0][0][0][0], 0, bounds, thresholds, output_integrals);
 
-    produce_output(bounds_strings, output_integrals, &input_data_packet);
+    produce_output(bounds_strings, output_integrals + OUTPUT_HEADER_WORDS, &input_data_packet);
 }
\ No newline at end of file
@@ -29,18 +29,27 @@ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 
 #define DATA_SIZE 4096
-
-// char: 8 bit, short: 16 bit, long: 32 bit
-
-#define NUM_CHANNELS 16
-#define NUM_SAMPLES 256 // N
-#define BUF_SIZE 4105 // 8 + N*16 + 1 words (16 bits / 2 bytes per word)
+#define BATCH_SIZE 64 // Packets per kernel invocation
+#define NUM_READERS 2 // Decoder threads per card, each taking every num_lanes-th batch
+#define SLOTS_PER_READER 4 // Batches each reader can have in flight
+#define RING_CAPACITY 8 // Power of two, at least SLOTS_PER_READER
+#define INGEST_DEPTH 4 // Chunk reads in flight (or read ahead) per reader
+#define HIST_MERGE_MILLISECONDS 100 // How long a dispatcher histograms privately before merging
+#define HIST_SNAPSHOT_SECONDS 10 // Histogram snapshot interval, SIGUSR1 takes one right away
+#define METRICS_INTERVAL_MILLISECONDS 1000 // How often --metrics publishes
+#define DAEMON_REQUEST_SECONDS 5 // How long the daemon waits for a client's job request
 
 
 #include <vector>
+#include <algorithm>
 #include <unistd.h>
 #include <iostream>
 #include <fstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <memory>
 #include <CL/cl2.hpp>
 
 #include <fcntl.h>
@@ -49,144 +58,238 @@ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
+#include "preprocess.h"
+#include "buffer_pool.h"
+#include "integral_archive.h"
+#include "preprocess_daemon.h"
+#include "integral_histogram.h"
+#include "packet_framer.h"
+#include "pipeline_metrics.h"
+#include "packet_json.h"
 
-/*
- Mimics incoming data packet in C types.
-*/
-struct SW_Data_Packet {
-    uint16_t alpha; // Start Constant 0xA1FA
-    uint8_t i2c_address; // 3 bits
-    uint8_t conf_address; // 4 bits
-    uint8_t bank; // 1 bit, A or B
-    uint8_t fine_time; // 8 bits, sample number when trigger arrives
-    uint32_t coarse_time; // 32 bits
-    uint16_t trigger_number; // 16 bits
-    uint8_t samples_after_trigger; // 8 bits
-    uint8_t look_back_samples; // 8 bits
-    uint8_t samples_to_be_read; // 8 bits
-    uint8_t starting_sample_number; // 8 bits
-    uint8_t number_of_missed_triggers; // 8 bits
-    uint8_t state_machine_status; // 8 bits
-    uint16_t samples[NUM_SAMPLES][NUM_CHANNELS]; // Variable size?
-    // Looks like N samples for 16 channels (so 1 ASIC)
-    uint16_t omega; // End Constant 0x0E6A
-};
-
-int data_packet_dat_to_struct(int fd, SW_Data_Packet * data_packet){
 
-    // Read data into a larger buffer and then strip 
-    // all of the spaces because dat files are bit-space-delineated.
+// Reads until count bytes or end of file, retrying short reads and EINTR.
+// Returns the bytes read, or -1 on error.
+ssize_t pread_full(int fd, uint8_t * buf, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = pread(fd, buf + done, count - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
 
-    // The times two is to account for the space-delineation
-    int num_bits = BUF_SIZE * 16 * 2;
-    uint8_t og_buf[num_bits];
+/*
+ Reads every stride-th chunk of a run file, starting at chunk first, into
+ 4K-aligned buffers. Each read also takes overlap bytes of the following
+ chunk, so a packet that starts in this chunk can be framed whole wherever
+ it ends. With liburing, INGEST_DEPTH reads are kept in flight per
+ reader, each into its own buffer. Otherwise each reader thread does its
+ own large pread into a single buffer (the readers are the I/O thread
+ pool) and asks the kernel to read ahead its next INGEST_DEPTH chunks.
+*/
+#ifdef HAVE_LIBURING
+#define INGEST_BUFFERS INGEST_DEPTH
+#else
+#define INGEST_BUFFERS 1
+#endif
 
-    if (read(fd, og_buf, num_bits) == -1) {
-        perror("read");
+class Chunk_Reader {
+public:
+    Chunk_Reader(int fd, size_t chunk_bytes, size_t overlap, off_t first, off_t stride)
+        : fd(fd), chunk_bytes(chunk_bytes), read_bytes(chunk_bytes + overlap), next_chunk(first), stride(stride),
+          oldest(0), returned(-1) {
+        if (buffer_pool_init(&pool, read_bytes, INGEST_BUFFERS) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < INGEST_BUFFERS; i++) {
+            buffers[i] = (uint8_t *) buffer_pool_slot(&pool, buffer_pool_acquire(&pool));
+        }
+        for (int i = 0; i < INGEST_DEPTH; i++) {
+            chunk_idx[i] = first + i*stride;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#ifdef HAVE_LIBURING
+        if (io_uring_queue_init(INGEST_DEPTH, &ring, 0) < 0) {
+            printf("io_uring_queue_init failed\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < INGEST_DEPTH; i++) {
+            submit(i);
+        }
+        io_uring_submit(&ring);
+#else
+        for (int i = 0; i < INGEST_DEPTH; i++) {
+            posix_fadvise(fd, chunk_idx[i] * chunk_bytes, read_bytes, POSIX_FADV_WILLNEED);
+        }
+#endif
     }
 
-    for (int i = 0; i < num_bits; i++) {
-        og_buf[i] = og_buf[i] - 0x30; // 0 in ASCII
+    ~Chunk_Reader() {
+#ifdef HAVE_LIBURING
+        // Reap reads still in flight before their buffers go away
+        for (int i = 0; i < INGEST_DEPTH; i++) {
+            while (!completed[i]) {
+                reap();
+            }
+        }
+        io_uring_queue_exit(&ring);
+#endif
+        buffer_pool_destroy(&pool);
     }
 
-    uint16_t buf[BUF_SIZE];
-    uint8_t ms_half, ls_half;
-    int base = 0;
-    for (int i = 0; i < BUF_SIZE; i++) {
-        base = i * 32;
-        ms_half = (og_buf[base] << 7) | (og_buf[base + 2] << 6) | (og_buf[base + 4] << 5) | (og_buf[base + 6] << 4) | (og_buf[base + 8] << 3) | (og_buf[base + 10] << 2) | (og_buf[base + 12] << 1) | og_buf[base + 14];
-        ls_half = (og_buf[base + 16] << 7) | (og_buf[base + 18] << 6) | (og_buf[base + 20] << 5) | (og_buf[base + 22] << 4) | (og_buf[base + 24] << 3) | (og_buf[base + 26] << 2) | (og_buf[base + 28] << 1) | og_buf[base + 30];
-        buf[i] = (ms_half << 8) | ls_half;
+    // Returns the next chunk in file order and its size with the overlap,
+    // which is less than chunk_bytes + overlap near the end of the file, 0
+    // past it and -1 on error. The data stays valid until the next call.
+    ssize_t next(const uint8_t ** data) {
+#ifdef HAVE_LIBURING
+        // Recycle the buffer returned last time for the chunk INGEST_DEPTH ahead
+        if (returned >= 0) {
+            chunk_idx[returned] += INGEST_DEPTH*stride;
+            submit(returned);
+            io_uring_submit(&ring);
+        }
+        while (!completed[oldest]) {
+            reap();
+        }
+        ssize_t bytes = results[oldest];
+        if (bytes >= 0 && (size_t) bytes < read_bytes) {
+            // Short read, finish it synchronously (hits end of file if genuinely short)
+            ssize_t rest = pread_full(fd, buffers[oldest] + bytes, read_bytes - bytes, chunk_idx[oldest]*chunk_bytes + bytes);
+            bytes = (rest == -1) ? -1 : bytes + rest;
+        }
+#else
+        ssize_t bytes = pread_full(fd, buffers[0], read_bytes, next_chunk*chunk_bytes);
+        posix_fadvise(fd, (next_chunk + INGEST_DEPTH*stride) * chunk_bytes, read_bytes, POSIX_FADV_WILLNEED);
+#endif
+        *data = buffers[oldest];
+        returned = oldest;
+#ifdef HAVE_LIBURING
+        oldest = (oldest + 1) % INGEST_DEPTH;
+#endif
+        next_chunk += stride;
+        return bytes;
     }
 
-    // First short should be 0xA1FA
-    if (buf[0] != 0xa1fa) {
-        printf("File must start with word 0xA1FA.\n");
-        return -2;
+private:
+#ifdef HAVE_LIBURING
+    void submit(int slot) {
+        struct io_uring_sqe * sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_read(sqe, fd, buffers[slot], read_bytes, chunk_idx[slot]*chunk_bytes);
+        io_uring_sqe_set_data(sqe, (void *) (intptr_t) slot);
+        completed[slot] = 0;
     }
 
-    data_packet->alpha = buf[0];
-    data_packet->i2c_address = 0b111 & (buf[1] >> 13);
-    data_packet->conf_address = 0b1111 & (buf[1] >> 9);
-    data_packet->bank = 0b1 & (buf[1] >> 8);
-    data_packet->fine_time = 0xff & buf[1];
-    data_packet->coarse_time = (((uint32_t) buf[2]) << 16) & (((uint32_t) buf[3]) & 0xffff);
-    data_packet->trigger_number = buf[4];
-    data_packet->samples_after_trigger = (buf[5] >> 8) & 0xff;
-    data_packet->look_back_samples = buf[5] & 0xff;
-    data_packet->samples_to_be_read = (buf[6] >> 8) & 0xff;
-    data_packet->starting_sample_number = buf[6] & 0xff;
-    data_packet->number_of_missed_triggers = (buf[7] >> 8) & 0xff;
-    data_packet->state_machine_status = buf[7] & 0xff;
-
-    int buf_idx = 8;
-    for (int i = 0; i < data_packet->samples_to_be_read + 1; i++) {
-        for (int j = 0; j < NUM_CHANNELS; j++) {
-            data_packet->samples[i][j] = buf[buf_idx] & 0xfff;
-            buf_idx++;
+    // Completions can arrive out of order, so they are parked by slot
+    void reap() {
+        struct io_uring_cqe * cqe;
+        if (io_uring_wait_cqe(&ring, &cqe) < 0) {
+            printf("io_uring_wait_cqe failed\n");
+            exit(EXIT_FAILURE);
         }
+        int slot = (intptr_t) io_uring_cqe_get_data(cqe);
+        results[slot] = cqe->res;
+        if (cqe->res < 0) {
+            errno = -cqe->res;
+            perror("io_uring read");
+            results[slot] = -1;
+        }
+        completed[slot] = 1;
+        io_uring_cqe_seen(&ring, cqe);
     }
 
-    // Last short should be 0x0E6A
-    if (buf[buf_idx] != 0x0e6a) {
-        printf("File must end with word 0x0E6A.\n");
-        return -3;
-    }
-    data_packet->omega = buf[buf_idx];
-
-    return 0;
-}
+    struct io_uring ring;
+    ssize_t results[INGEST_DEPTH];
+    int completed[INGEST_DEPTH];
+#endif
+    int fd;
+    size_t chunk_bytes;
+    size_t read_bytes; // chunk_bytes plus the overlap
+    off_t next_chunk;
+    off_t stride;
+    int oldest; // Slot holding the next chunk in order
+    int returned; // Slot handed out by the last next()
+    struct Buffer_Pool pool;
+    uint8_t * buffers[INGEST_BUFFERS];
+    off_t chunk_idx[INGEST_DEPTH];
+};
 
+// Returns -1 if the file is short or a line doesn't hold a sample number and NUM_CHANNELS pedestals
 int peds_dat_to_arrays(int fd, uint16_t * all_peds){
     FILE * fp = fdopen(fd, "r");
     if(fp == NULL) {
         perror("fdopen");
+        close(fd);
+        return -1;
     }
 
     uint16_t sample_num;
     uint16_t peds[NUM_CHANNELS];
     char line[100];
-    for(int i = 0; i < NUM_SAMPLES; i++) {
-        line[0] = '\0';
-        if(fgets(line, sizeof(line), fp) == NULL) {
-            perror("fgets");
-        }
-        sscanf(line, "%hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu", &sample_num, &peds[0], &peds[1], &peds[2], &peds[3], &peds[4], &peds[5], &peds[6], &peds[7], &peds[8], &peds[9], &peds[10], &peds[11], &peds[12], &peds[13], &peds[14], &peds[15]);
-        for(int j = 0; j < NUM_CHANNELS; j++) {
-            all_peds[0*(NUM_SAMPLES*NUM_CHANNELS) + i*NUM_CHANNELS + j] = peds[j];
-        }
-    }
-    for(int i = 0; i < NUM_SAMPLES; i++) {
-        line[0] = '\0';
-        if(fgets(line, sizeof(line), fp) == NULL) {
-            perror("fgets");
-        }
-        sscanf(line, "%hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu", &sample_num, &peds[0], &peds[1], &peds[2], &peds[3], &peds[4], &peds[5], &peds[6], &peds[7], &peds[8], &peds[9], &peds[10], &peds[11], &peds[12], &peds[13], &peds[14], &peds[15]);
-        for(int j = 0; j < NUM_CHANNELS; j++) {
-            all_peds[1*(NUM_SAMPLES*NUM_CHANNELS) + i*NUM_CHANNELS + j] = peds[j];
+    for(int bank = 0; bank < 2; bank++) {
+        for(int i = 0; i < NUM_SAMPLES; i++) {
+            if(fgets(line, sizeof(line), fp) == NULL) {
+                printf("Pedestal file ends at bank %d sample %d.\n", bank, i);
+                fclose(fp);
+                return -1;
+            }
+            if(sscanf(line, "%hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu", &sample_num, &peds[0], &peds[1], &peds[2], &peds[3], &peds[4], &peds[5], &peds[6], &peds[7], &peds[8], &peds[9], &peds[10], &peds[11], &peds[12], &peds[13], &peds[14], &peds[15]) != 1 + NUM_CHANNELS) {
+                printf("Malformed pedestal line at bank %d sample %d.\n", bank, i);
+                fclose(fp);
+                return -1;
+            }
+            for(int j = 0; j < NUM_CHANNELS; j++) {
+                all_peds[bank*(NUM_SAMPLES*NUM_CHANNELS) + i*NUM_CHANNELS + j] = peds[j];
+            }
         }
     }
     fclose(fp);
     return 0;
 }
 
-int initialize_inputs(SW_Data_Packet * data_packet, uint16_t * all_peds) {
-    int data_packet_fd = open("../../src/EventStream.dat", 0, "r");
-    if (data_packet_fd == -1) {
+int load_peds(const char * peds_file, uint16_t * all_peds) {
+    int peds_fd = open(peds_file, 0, "r");
+    if (peds_fd == -1) {
         perror("open");
+        return -1;
     }
 
-    data_packet_dat_to_struct(data_packet_fd, data_packet);
+    return peds_dat_to_arrays(peds_fd, all_peds);
+}
 
-    int peds_fd = open("../../src/peds.dat", 0, "r");
-    if (peds_fd == -1) {
-        perror("open");
-    }
+/*
+ Pedestals live on the device in two generations (slots). A new table is
+ written into the slot the running batches aren't using, and batches after
+ that pass the new generation to the kernel.
+*/
+volatile sig_atomic_t peds_reload_requested = 0;
 
-    peds_dat_to_arrays(peds_fd, all_peds);
+void request_peds_reload(int signum) {
+    peds_reload_requested = 1;
+}
 
-    return 0;
+int upload_peds(cl::CommandQueue &q, cl::Buffer &ped_tables_buf, unsigned int generation, uint16_t * all_peds) {
+    size_t slot_bytes = sizeof(uint16_t) * PED_TABLE_SIZE;
+    return q.enqueueWriteBuffer(ped_tables_buf, CL_FALSE, (generation % 2) * slot_bytes, slot_bytes, all_peds);
 }
 
 int write_header(int fd, char * field, uint32_t value) {
@@ -199,24 +302,65 @@ int write_header(int fd, char * field, uint32_t value) {
     return 0;
 }
 
-int write_integrals(int fd, char ** bounds, int32_t *integrals) {
-    char value_ptr[10];
-    for (int i = 0; i < 4; i++) {
-        sprintf(value_ptr, "%d (%s,%s)", i, bounds[i*2], bounds[i*2+1]);
+int thresholds_dat_to_array(int fd, int32_t * thresholds) {
+    FILE * fp = fdopen(fd, "r");
+    if(fp == NULL) {
+        perror("fdopen");
+        return -1;
+    }
+
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        if (fscanf(fp, "%d", &thresholds[j]) != 1) {
+            printf("Thresholds file must hold %d values.\n", NUM_CHANNELS);
+            fclose(fp);
+            return -2;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Reads a sparse record (channel mask, then CHANNEL_WORDS per kept channel)
+// and writes only the kept channels, one line per window followed by one
+// line per pulse feature. Returns the number of words consumed.
+int write_integrals(int fd, char ** bounds, int32_t *record) {
+    char value_ptr[32];
+    const char * feature_names[NUM_FEATURES] = {"peak", "peak_time", "cfd_time"};
+    uint32_t mask = record[0];
+    int num_kept = 0;
+    for (int i = 0; i < CHANNEL_WORDS; i++) {
+        if (i < NUM_WINDOWS) {
+            sprintf(value_ptr, "%d (%s,%s)", i, bounds[i*2], bounds[i*2+1]);
+        }
+        else {
+            sprintf(value_ptr, "%s", feature_names[i-NUM_WINDOWS]);
+        }
         write(fd, value_ptr, strlen(value_ptr));
         write(fd, "   ", 3);
+        num_kept = 0;
         for (int j = 0; j < NUM_CHANNELS; j++) {
-            //sprintf(value_ptr, "%d", integrals[i][j]);
-            sprintf(value_ptr, "%d", *(integrals+i*NUM_CHANNELS+j));
-            write(fd, " ", 1);
-            write(fd, value_ptr, strlen(value_ptr));
+            if (mask & (1 << j)) {
+                int32_t value = record[1 + num_kept*CHANNEL_WORDS + i];
+                if (i == CHANNEL_WORDS-1 && value == CFD_NO_CROSSING) {
+                    sprintf(value_ptr, "-");
+                }
+                else if (i == CHANNEL_WORDS-1) {
+                    sprintf(value_ptr, "%.2f", (double) value / (1 << CFD_TIME_SHIFT));
+                }
+                else {
+                    sprintf(value_ptr, "%d", value);
+                }
+                write(fd, " ", 1);
+                write(fd, value_ptr, strlen(value_ptr));
+                num_kept++;
+            }
         }
         write(fd, "\n", 1);
     }
-    return 0;
+    return 1 + num_kept*CHANNEL_WORDS;
 }
 
-int write_output(int fd, char ** bounds, int32_t *integrals, SW_Data_Packet * data_packet) {
+int write_output(int fd, char ** bounds, int32_t *record, unsigned int ped_generation, SW_Data_Packet * data_packet) {
     write_header(fd, "i2c_address", data_packet->i2c_address);
     write_header(fd, "conf_address", data_packet->conf_address);
     write_header(fd, "bank", data_packet->bank);
@@ -229,101 +373,1227 @@ int write_output(int fd, char ** bounds, int32_t *integrals, SW_Data_Packet * da
     write_header(fd, "starting_sample_number", data_packet->starting_sample_number);
     write_header(fd, "number_of_missed_triggers", data_packet->number_of_missed_triggers);
     write_header(fd, "state_machine_status", data_packet->state_machine_status);
-    write_integrals(fd, bounds, integrals);
+    write_header(fd, "ped_generation", ped_generation);
+    write_header(fd, "channel_mask", record[0]);
+    return write_integrals(fd, bounds, record);
+}
+
+int produce_output(int output_fd, char ** bounds, int32_t *batch_output, int num_packets, SW_Data_Packet * data_packets) {
+    unsigned int ped_generation = batch_output[0];
+    int record_idx = OUTPUT_HEADER_WORDS;
+    for (int n = 0; n < num_packets; n++) {
+        record_idx += write_output(output_fd, bounds, batch_output + record_idx, ped_generation, &data_packets[n]);
+    }
     return 0;
 }
 
-int produce_output(char ** bounds, int32_t *integrals, SW_Data_Packet * data_packet) {
-    int output_fd = open("output.txt", O_CREAT | O_RDWR, 0666);
-    if (output_fd == -1) {
-        perror("open");
+int archive_output(struct Archive_Writer * archive, int32_t *batch_output, int num_packets, SW_Data_Packet * data_packets) {
+    struct Archive_Event event;
+    int record_idx = OUTPUT_HEADER_WORDS;
+    for (int n = 0; n < num_packets; n++) {
+        SW_Data_Packet * data_packet = &data_packets[n];
+        event.i2c_address = data_packet->i2c_address;
+        event.conf_address = data_packet->conf_address;
+        event.bank = data_packet->bank;
+        event.fine_time = data_packet->fine_time;
+        event.coarse_time = data_packet->coarse_time;
+        event.trigger_number = data_packet->trigger_number;
+        event.samples_after_trigger = data_packet->samples_after_trigger;
+        event.look_back_samples = data_packet->look_back_samples;
+        event.samples_to_be_read = data_packet->samples_to_be_read;
+        event.starting_sample_number = data_packet->starting_sample_number;
+        event.number_of_missed_triggers = data_packet->number_of_missed_triggers;
+        event.state_machine_status = data_packet->state_machine_status;
+        event.ped_generation = batch_output[0];
+        int record_words = 1 + __builtin_popcount(batch_output[record_idx]) * CHANNEL_WORDS;
+        memcpy(event.record, batch_output + record_idx, sizeof(int32_t) * record_words);
+        if (archive_append(archive, &event) != 0) {
+            return -1;
+        }
+        record_idx += record_words;
     }
+    return 0;
+}
+
+/*
+ --json: event-display dump of the selected packets (see packet_json.h),
+ with the header, samples and sparse record of each. The pedestal-
+ subtracted samples stay on the card, so the lines carry the pedestal
+ generation instead.
+*/
+int json_output(struct Json_Exporter * json, int32_t *batch_output, int num_packets, SW_Data_Packet * data_packets) {
+    struct Json_Extras extras;
+    extras.ped_generation = (uint32_t) batch_output[0];
+    extras.ped_sub = NULL;
+    int record_idx = OUTPUT_HEADER_WORDS;
+    for (int n = 0; n < num_packets; n++) {
+        extras.record = batch_output + record_idx;
+        if (json_exporter_wants(json, data_packets[n].trigger_number) && json_export_packet(json, &data_packets[n], &extras) != 0) {
+            return -1;
+        }
+        record_idx += 1 + __builtin_popcount(batch_output[record_idx]) * CHANNEL_WORDS;
+    }
+    return 0;
+}
+
+/*
+ Live integral spectra (see integral_histogram.h). Dispatchers histogram
+ the batches they read back into private fills and merge them into the
+ totals every HIST_MERGE_MILLISECONDS, so snapshots lag by about that. The writer takes a snapshot of
+ the totals every HIST_SNAPSHOT_SECONDS, or on SIGUSR1, while the
+ pipeline keeps running.
+*/
+struct Histogram_Monitor {
+    const char * snapshot_file;
+    std::mutex lock; // Guards totals
+    struct Integral_Histograms totals;
+    struct Integral_Histograms snapshot; // Copy being written out
+};
+
+volatile sig_atomic_t histogram_snapshot_requested = 0;
+
+void request_histogram_snapshot(int signum) {
+    histogram_snapshot_requested = 1;
+}
+
+void histogram_batch(struct Histogram_Fill * fill, const struct Histogram_Binning * binning,
+                     int32_t *batch_output, int num_packets, SW_Data_Packet * data_packets) {
+    int record_idx = OUTPUT_HEADER_WORDS;
+    for (int n = 0; n < num_packets; n++) {
+        record_idx += histogram_fill_record(fill, binning, data_packets[n].bank & 1, batch_output + record_idx);
+    }
+}
 
-    write_output(output_fd, bounds, integrals, data_packet);
+void merge_histograms(Histogram_Monitor * monitor, struct Histogram_Fill * fill) {
+    std::lock_guard<std::mutex> guard(monitor->lock);
+    histograms_merge(&monitor->totals, fill);
+}
+
+// Written next to the snapshot file and renamed over it, so readers never see a partial snapshot
+int write_histogram_snapshot(Histogram_Monitor * monitor) {
+    {
+        std::lock_guard<std::mutex> guard(monitor->lock);
+        memcpy(&monitor->snapshot, &monitor->totals, sizeof(monitor->snapshot));
+    }
+    std::string tmp_file = std::string(monitor->snapshot_file) + ".tmp";
+    FILE * fp = fopen(tmp_file.c_str(), "w");
+    if (fp == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    int status = histograms_write(&monitor->snapshot, fp);
+    if (fclose(fp) != 0 || status != 0 || rename(tmp_file.c_str(), monitor->snapshot_file) != 0) {
+        perror("snapshot");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ Host pipeline: reader threads decode packets into batch slots, a
+ dispatcher thread per card runs the batches on the device, and a writer
+ thread formats the results in order. Every hand-off is a bounded single-producer
+ single-consumer ring, so a stage that falls behind makes the one before
+ it wait (backpressure) and shows up in that ring's stall counters.
+*/
+struct Batch {
+    int lane; // Owner, the slot goes back to this lane's free ring
+    int num_packets;
+    int chunk_continues; // More of the same chunk follows in this lane's next batch
+    int end_of_stream; // Last batch, may hold fewer than BATCH_SIZE packets
+    // On a chunk's last batch, where its frames are, and on the last batch where the stream ends
+    struct Frame_Span span;
+    int64_t stream_end;
+    std::chrono::steady_clock::time_point taken; // When the reader took the slot
+    // Pool slots, each wrapped once in a CL_MEM_USE_HOST_PTR buffer
+    struct SW_Data_Packet * packets;
+    int32_t * output;
+    cl::Buffer packets_buf;
+    cl::Buffer output_buf;
+};
+
+template <class T, size_t CAPACITY>
+class Spsc_Ring {
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+public:
+    Spsc_Ring() : head(0), tail(0), push_stalls(0), pop_stalls(0), push_stall_ns(0), pop_stall_ns(0),
+                  max_depth(0), depth_sum(0), num_pushed(0) {}
+
+    bool try_push(const T &item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == CAPACITY) {
+            return false;
+        }
+        slots[t & (CAPACITY - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+
+        size_t depth = t + 1 - head.load(std::memory_order_relaxed);
+        if (depth > max_depth.load(std::memory_order_relaxed)) {
+            max_depth.store(depth, std::memory_order_relaxed);
+        }
+        depth_sum.fetch_add(depth, std::memory_order_relaxed);
+        num_pushed.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool try_pop(T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == h) {
+            return false;
+        }
+        item = slots[h & (CAPACITY - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Blocking versions spin with yield and count each wait as one stall
+    void push(const T &item) {
+        if (try_push(item)) {
+            return;
+        }
+        auto wait_start = std::chrono::steady_clock::now();
+        while (!try_push(item)) {
+            std::this_thread::yield();
+        }
+        push_stalls.fetch_add(1, std::memory_order_relaxed);
+        push_stall_ns.fetch_add(elapsed_ns(wait_start), std::memory_order_relaxed);
+    }
+
+    T pop() {
+        T item;
+        if (try_pop(item)) {
+            return item;
+        }
+        auto wait_start = std::chrono::steady_clock::now();
+        while (!try_pop(item)) {
+            std::this_thread::yield();
+        }
+        pop_stalls.fetch_add(1, std::memory_order_relaxed);
+        pop_stall_ns.fetch_add(elapsed_ns(wait_start), std::memory_order_relaxed);
+        return item;
+    }
+
+    // Items queued, as seen from any thread. May be one off while either end moves.
+    size_t depth() const {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_relaxed);
+        return (t - h <= CAPACITY) ? t - h : 0;
+    }
+
+    void print_stats(const char * name) {
+        uint64_t pushed = num_pushed.load();
+        printf("INFO: %-10s pushed %lu, depth avg %.2f max %lu/%lu, producer stalls %lu (%.3f ms), consumer stalls %lu (%.3f ms)\n",
+               name, (unsigned long) pushed, pushed ? (double) depth_sum.load() / pushed : 0.0,
+               (unsigned long) max_depth.load(), (unsigned long) CAPACITY,
+               (unsigned long) push_stalls.load(), push_stall_ns.load() / 1e6,
+               (unsigned long) pop_stalls.load(), pop_stall_ns.load() / 1e6);
+    }
+
+private:
+    static uint64_t elapsed_ns(std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+    }
+
+    T slots[CAPACITY];
+    alignas(64) std::atomic<size_t> head; // Written by the consumer only
+    alignas(64) std::atomic<size_t> tail; // Written by the producer only
+    // Producer-side counters first, then consumer-side
+    alignas(64) std::atomic<uint64_t> push_stalls;
+    std::atomic<uint64_t> pop_stalls;
+    std::atomic<uint64_t> push_stall_ns;
+    std::atomic<uint64_t> pop_stall_ns;
+    std::atomic<uint64_t> max_depth;
+    std::atomic<uint64_t> depth_sum;
+    std::atomic<uint64_t> num_pushed;
+};
+
+typedef Spsc_Ring<Batch *, RING_CAPACITY> Batch_Ring;
+
+/*
+ Live metrics (see pipeline_metrics.h). Each pipeline thread counts into
+ a Thread_Metrics of its own, a cache line that only it writes, so a
+ count is a relaxed load and store with no read-modify-write and nothing
+ shared with the other threads. The publisher thread only reads them,
+ except that it resets max_ns, and a batch that finishes just then may
+ miss the next interval's maximum. The metrics live in Device_State, so
+ daemon jobs keep adding to the same totals.
+*/
+struct alignas(64) Thread_Metrics {
+    Thread_Metrics() : events(0), bytes(0), bad_frames(0), skipped_bytes(0), batches(0), busy_ns(0), max_ns(0) {}
+    std::atomic<uint64_t> events;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> bad_frames;
+    std::atomic<uint64_t> skipped_bytes;
+    std::atomic<uint64_t> batches;
+    std::atomic<uint64_t> busy_ns; // In the thread's stage
+    std::atomic<uint64_t> max_ns; // Slowest batch since the last publish
+};
+
+static inline void metric_add(std::atomic<uint64_t> &counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline void metric_batch(Thread_Metrics &metrics, uint64_t ns) {
+    metric_add(metrics.batches, 1);
+    metric_add(metrics.busy_ns, ns);
+    if (ns > metrics.max_ns.load(std::memory_order_relaxed)) {
+        metrics.max_ns.store(ns, std::memory_order_relaxed);
+    }
+}
+
+static inline void metric_framed(Thread_Metrics &metrics, const struct Framer_Stats &stats) {
+    metric_add(metrics.events, stats.num_frames);
+    metric_add(metrics.bad_frames, stats.num_bad);
+    metric_add(metrics.skipped_bytes, stats.skipped_bytes);
+}
+
+static inline uint64_t nanoseconds_since(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+struct Pipeline_Metrics {
+    std::chrono::steady_clock::time_point started;
+    std::vector<Thread_Metrics> readers; // By lane: events and bytes in, read latency
+    std::vector<Thread_Metrics> dispatchers; // By card: device latency
+    Thread_Metrics writer; // Events and bytes out, write latency, bad frames between chunks
+    Thread_Metrics pipeline; // Written by the writer, end-to-end latency
+    // Also the writer's
+    alignas(64) std::atomic<uint64_t> missed_triggers;
+    std::atomic<uint64_t> status_counts[METRICS_STATUS_CODES];
+    // Written by the thread running jobs
+    alignas(64) std::atomic<uint64_t> jobs_started;
+    std::atomic<uint64_t> jobs_finished;
+    // The running job's rings, NULL between jobs. Only taken when a job
+    // starts or ends and by the publisher, which reads their depths.
+    std::mutex rings_lock;
+    Batch_Ring * free_rings;
+    Batch_Ring * filled_rings;
+    Batch_Ring * done_rings;
+};
+
+/*
+ The run file is sharded across the cards by chunk: chunk k (BATCH_SIZE
+ packet slots of bytes) goes to lane k % num_lanes, and lane l runs on
+ card l % num_cards, so every card sees whole, contiguous chunks. Each
+ lane has its own reader and rings, and the writer takes the lanes
+ round-robin, which puts the results back in file (and so trigger) order.
+
+ A chunk owns the packets whose alpha word starts in it. Packets shorter
+ than a slot, or bytes lost and resynchronized past, can put more than
+ BATCH_SIZE of them in one chunk, so it then spans several batches, all
+ but the last marked chunk_continues, and the consumers stay on the lane
+ until the chunk is done.
+*/
+
+// Lane k frames chunks k, k + num_lanes, ... and counts into stats. What
+// is skipped between chunks is left to the writer, which sees them in order.
+void reader_thread(int lane, int num_lanes, int data_packet_fd, Batch_Ring * free_ring, Batch_Ring * filled_ring,
+                   struct Framer_Stats * stats, Thread_Metrics * metrics) {
+    const size_t chunk_bytes = (size_t) BATCH_SIZE * PACKET_BYTES;
+    Chunk_Reader chunks(data_packet_fd, chunk_bytes, FRAME_MAX_BYTES, lane, num_lanes);
+    struct Framer_Stats lane_stats = {0, 0, 0}; // Kept local, the lanes' stats share cache lines
+    int end_of_stream = 0;
+    for (off_t chunk_idx = lane; !end_of_stream; chunk_idx += num_lanes) {
+        const uint8_t * chunk;
+        ssize_t bytes = chunks.next(&chunk);
+        bytes = (bytes > 0) ? bytes : 0;
+        // A chunk that doesn't reach into the next one is the last
+        end_of_stream = ((size_t) bytes <= chunk_bytes);
+        size_t own_bytes = std::min((size_t) bytes, chunk_bytes);
+        struct Framer_Stats chunk_stats = {0, 0, 0};
+        struct Framer framer;
+        framer_init(&framer, chunk, own_bytes, bytes, chunk_idx * chunk_bytes, &chunk_stats);
+
+        Batch * batch = free_ring->pop();
+        batch->num_packets = 0;
+        batch->taken = std::chrono::steady_clock::now();
+        const uint8_t * frame;
+        long frame_bytes;
+        while ((frame = framer_next(&framer, &frame_bytes)) != NULL) {
+            if (batch->num_packets == BATCH_SIZE) {
+                batch->chunk_continues = 1;
+                batch->end_of_stream = 0;
+                metric_batch(*metrics, nanoseconds_since(batch->taken));
+                filled_ring->push(batch);
+                batch = free_ring->pop();
+                batch->num_packets = 0;
+                batch->taken = std::chrono::steady_clock::now();
+            }
+            frame_decode(frame, &batch->packets[batch->num_packets++]);
+        }
+        batch->chunk_continues = 0;
+        batch->end_of_stream = end_of_stream;
+        batch->span = framer.span;
+        batch->stream_end = chunk_idx * chunk_bytes + bytes;
+        metric_batch(*metrics, nanoseconds_since(batch->taken));
+        metric_framed(*metrics, chunk_stats);
+        metric_add(metrics->bytes, own_bytes);
+        filled_ring->push(batch);
+
+        lane_stats.num_frames += chunk_stats.num_frames;
+        lane_stats.num_bad += chunk_stats.num_bad;
+        lane_stats.skipped_bytes += chunk_stats.skipped_bytes;
+    }
+    *stats = lane_stats;
+}
+
+// Counts what the ASICs report in each packet header. missed is each
+// ASIC's last number_of_missed_triggers, -1 before its first packet of the
+// job, whose count is only taken as the starting point.
+void count_packet_status(Pipeline_Metrics * metrics, int16_t * missed, int num_packets, SW_Data_Packet * data_packets) {
+    uint64_t missed_triggers = 0;
+    for (int n = 0; n < num_packets; n++) {
+        const SW_Data_Packet * data_packet = &data_packets[n];
+        int asic = ((data_packet->i2c_address & 0x7) << 4) | (data_packet->conf_address & 0xf);
+        uint8_t count = data_packet->number_of_missed_triggers;
+        if (missed[asic] >= 0) {
+            missed_triggers += (uint8_t) (count - missed[asic]); // The 8-bit count wraps
+        }
+        missed[asic] = count;
+        metric_add(metrics->status_counts[data_packet->state_machine_status & 0xff], 1);
+    }
+    metric_add(metrics->missed_triggers, missed_triggers);
+}
+
+// archive, monitor and json are NULL unless an archive, histogram or JSON file was given
+void writer_thread(int output_fd, char ** bounds, struct Archive_Writer * archive, Histogram_Monitor * monitor,
+                   struct Json_Exporter * json, Batch_Ring * done_rings, Batch_Ring * free_rings, int num_lanes, struct Framer_Stats * stats,
+                   Pipeline_Metrics * metrics) {
+    auto last_snapshot = std::chrono::steady_clock::now();
+    struct Frame_Span stream_span;
+    frame_span_init(&stream_span);
+    int16_t missed[128]; // By ASIC, see count_packet_status
+    memset(missed, 0xff, sizeof(missed));
+    off_t output_bytes = 0;
+    int end_of_stream = 0;
+    int l = 0;
+    while (!end_of_stream) {
+        Batch * batch = done_rings[l].pop();
+        auto started = std::chrono::steady_clock::now();
+        if (monitor != NULL && (histogram_snapshot_requested ||
+                                std::chrono::steady_clock::now() - last_snapshot >= std::chrono::seconds(HIST_SNAPSHOT_SECONDS))) {
+            histogram_snapshot_requested = 0;
+            write_histogram_snapshot(monitor);
+            last_snapshot = std::chrono::steady_clock::now();
+        }
+        if (batch->num_packets > 0) {
+            produce_output(output_fd, bounds, batch->output, batch->num_packets, batch->packets);
+            if (archive != NULL) {
+                archive_output(archive, batch->output, batch->num_packets, batch->packets);
+            }
+            if (json != NULL) {
+                json_output(json, batch->output, batch->num_packets, batch->packets);
+            }
+            count_packet_status(metrics, missed, batch->num_packets, batch->packets);
+            // One lseek per batch, rather than counting each of the many small writes
+            off_t position = lseek(output_fd, 0, SEEK_CUR);
+            if (position > output_bytes) {
+                metric_add(metrics->writer.bytes, position - output_bytes);
+                output_bytes = position;
+            }
+        }
+        end_of_stream = batch->end_of_stream;
+        if (!batch->chunk_continues) {
+            struct Framer_Stats gap_stats = {0, 0, 0};
+            if (batch->span.first_start >= 0) {
+                framer_count_gap(&gap_stats, &stream_span, batch->span.first_start);
+                stream_span.last_start = batch->span.last_start;
+                stream_span.last_end = batch->span.last_end;
+            }
+            if (end_of_stream) {
+                framer_count_gap(&gap_stats, &stream_span, batch->stream_end);
+            }
+            metric_framed(metrics->writer, gap_stats);
+            stats->num_bad += gap_stats.num_bad;
+            stats->skipped_bytes += gap_stats.skipped_bytes;
+            l = (l + 1) % num_lanes;
+        }
+        metric_add(metrics->writer.events, batch->num_packets);
+        metric_batch(metrics->writer, nanoseconds_since(started));
+        metric_batch(metrics->pipeline, nanoseconds_since(batch->taken));
+        free_rings[batch->lane].push(batch);
+    }
 }
 
 // Forward declaration of utility functions included at the end of this file
 std::vector<cl::Device> get_xilinx_devices();
 char *read_binary_file(const std::string &xclbin_file_name, unsigned &nb);
 
-// ------------------------------------------------------------------------------------
-// Main program
-// ------------------------------------------------------------------------------------
-int main(int argc, char **argv)
-{
+// One programmed accelerator and its resident buffers
+struct Card {
+    std::string name;
+    cl::Context context;
+    cl::CommandQueue q;
+    cl::Kernel krnl_preprocess;
+    cl::Buffer ped_tables_buf;
+    cl::Buffer bounds_buf;
+    cl::Buffer thresholds_buf;
+    int *bounds;
+    int32_t *thresholds;
+    unsigned int ped_generation; // Newest generation uploaded to this card
+    // Per-job throughput, written by the card's dispatcher only
+    uint64_t num_batches;
+    uint64_t num_events;
+    uint64_t busy_ns; // From the input migration to the end of the readback
+};
+
+/*
+ Everything that outlives a job: the programmed cards, the resident
+ pedestals and the pooled batch buffers. The one-shot mode sets this up
+ for a single job, the daemon once for all of them.
+*/
+struct Device_State {
+    std::vector<Card> cards;
+    int num_lanes; // NUM_READERS per card
+    struct Buffer_Pool packet_pool;
+    struct Buffer_Pool output_pool;
+    std::vector<Batch> batches;
+    const char * peds_file;
+    uint16_t staged_peds[2][PED_TABLE_SIZE]; // By generation % 2, like the device slots
+    std::atomic<unsigned int> ped_generation;
+    Pipeline_Metrics metrics;
+    struct Json_Exporter * json; // NULL without --json, else kept across jobs
+};
+
+struct Job {
+    const char * data_file;
+    const char * output_file;
+    const char * thresholds_file; // NULL keeps every channel
+    const char * archive_file; // NULL for no archive
+    const char * histogram_file; // NULL for no histograms
+    struct Histogram_Binning binning;
+    int bounds[2*NUM_WINDOWS];
+};
+
+int setup_device(Device_State &state, const std::string &binaryFile, const char * peds_file) {
     // ------------------------------------------------------------------------------------
-    // Step 1: Initialize the OpenCL environment
+    // Step 1: Initialize the OpenCL environment, on every card
     // ------------------------------------------------------------------------------------
     cl_int err;
-    std::string binaryFile = (argc != 2) ? "preprocess.xclbin" : argv[1]; // COMPILED BINARY
     unsigned fileBufSize;
     std::vector<cl::Device> devices = get_xilinx_devices();
-    devices.resize(1);
-    cl::Device device = devices[0];
-    cl::Context context(device, NULL, NULL, NULL, &err);
+    if (devices.empty()) {
+        std::cout << "ERROR: No accelerator found" << std::endl;
+        return -1;
+    }
     char *fileBuf = read_binary_file(binaryFile, fileBufSize);
     cl::Program::Binaries bins{{fileBuf, fileBufSize}};
-    cl::Program program(context, devices, bins, NULL, &err);
-    cl::CommandQueue q(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
-    cl::Kernel krnl_preprocess(program, "preprocess", &err); // HW FUNCTION NAME
-    // cl::Kernel krnl_new_name(program, "new_name", &err);
+    state.cards.resize(devices.size());
+    for (size_t d = 0; d < devices.size(); d++) {
+        Card &card = state.cards[d];
+        std::vector<cl::Device> device(1, devices[d]);
+        card.name = devices[d].getInfo<CL_DEVICE_NAME>();
+        card.context = cl::Context(devices[d], NULL, NULL, NULL, &err);
+        cl::Program program(card.context, device, bins, NULL, &err);
+        card.q = cl::CommandQueue(card.context, devices[d], CL_QUEUE_PROFILING_ENABLE, &err);
+        card.krnl_preprocess = cl::Kernel(program, "preprocess", &err); // HW FUNCTION NAME
+        std::cout << "INFO: Card " << d << " is " << card.name << std::endl;
+    }
+    delete[] fileBuf;
 
     // ------------------------------------------------------------------------------------
-    // Step 2: Create buffers and initialize test values
+    // Step 2: Create buffers and load the pedestals
     // ------------------------------------------------------------------------------------
+    // Generation 0 goes into slot 0. SIGHUP re-reads peds_file into the other slot.
+    state.peds_file = peds_file;
+    state.ped_generation = 0;
+    if (load_peds(peds_file, state.staged_peds[0]) != 0) {
+        return -1;
+    }
+
     // Create the buffers and allocate memory
-    cl::Buffer data_packet_buf(context, CL_MEM_READ_ONLY, sizeof(struct SW_Data_Packet), NULL, &err);
-    cl::Buffer all_peds_buf(context, CL_MEM_READ_ONLY, sizeof(uint16_t) * 2 * NUM_SAMPLES * NUM_CHANNELS, NULL, &err);
-    cl::Buffer bounds_buf(context, CL_MEM_READ_ONLY, sizeof(int) * 8, NULL, &err);
-    cl::Buffer output_integrals_buf(context, CL_MEM_WRITE_ONLY, sizeof(int32_t) * 4 * NUM_CHANNELS, NULL, &err);
-
-    // Map buffers to kernel arguments, thereby assigning them to specific device memory banks
-    krnl_preprocess.setArg(0, data_packet_buf);
-    krnl_preprocess.setArg(1, all_peds_buf);
-    krnl_preprocess.setArg(2, bounds_buf);
-    krnl_preprocess.setArg(3, output_integrals_buf);
-
-    // Map host-side buffer memory to user-space pointers
-    struct SW_Data_Packet * input_data_packet = (struct SW_Data_Packet *)q.enqueueMapBuffer(data_packet_buf, CL_TRUE, CL_MAP_WRITE, 0, sizeof(struct SW_Data_Packet));
-    uint16_t *input_all_peds = (uint16_t *)q.enqueueMapBuffer(all_peds_buf, CL_TRUE, CL_MAP_WRITE, 0, sizeof(uint16_t) * 2 * NUM_SAMPLES * NUM_CHANNELS);
-    int *bounds = (int *)q.enqueueMapBuffer(bounds_buf, CL_TRUE, CL_MAP_WRITE, 0, sizeof(int) * 8);
-    int32_t *output_integrals = (int32_t *)q.enqueueMapBuffer(output_integrals_buf, CL_TRUE, CL_MAP_WRITE | CL_MAP_READ, 0, sizeof(int32_t) * 4 * NUM_CHANNELS);
-
-    // Initialize the data used in the test
-    initialize_inputs(input_data_packet, input_all_peds);
-
-    char * bounds_strings[8] = {"-5", "5", "-10", "10", "-15", "15", "-20", "20"};
-    bounds[0] = atoi(bounds_strings[0]);
-    bounds[1] = atoi(bounds_strings[1]);
-    bounds[2] = atoi(bounds_strings[2]);
-    bounds[3] = atoi(bounds_strings[3]);
-    bounds[4] = atoi(bounds_strings[4]);
-    bounds[5] = atoi(bounds_strings[5]);
-    bounds[6] = atoi(bounds_strings[6]);
-    bounds[7] = atoi(bounds_strings[7]);
+    size_t batch_output_size = sizeof(int32_t) * (OUTPUT_HEADER_WORDS + BATCH_SIZE * SPARSE_RECORD_MAX_WORDS);
+    for (size_t d = 0; d < state.cards.size(); d++) {
+        Card &card = state.cards[d];
+        card.ped_tables_buf = cl::Buffer(card.context, CL_MEM_READ_ONLY, sizeof(uint16_t) * 2 * PED_TABLE_SIZE, NULL, &err);
+        card.bounds_buf = cl::Buffer(card.context, CL_MEM_READ_ONLY, sizeof(int) * 2 * NUM_WINDOWS, NULL, &err);
+        card.thresholds_buf = cl::Buffer(card.context, CL_MEM_READ_ONLY, sizeof(int32_t) * NUM_CHANNELS, NULL, &err);
 
-    // ------------------------------------------------------------------------------------
-    // Step 3: Run the kernel
-    // ------------------------------------------------------------------------------------
-    // Set kernel arguments
-    krnl_preprocess.setArg(0, data_packet_buf);
-    krnl_preprocess.setArg(1, all_peds_buf);
-    krnl_preprocess.setArg(2, bounds_buf);
-    krnl_preprocess.setArg(3, output_integrals_buf);
+        // Map buffers to kernel arguments, thereby assigning them to specific device memory banks.
+        // The packet and output buffers are per batch and set at dispatch.
+        card.krnl_preprocess.setArg(2, card.ped_tables_buf);
+        card.krnl_preprocess.setArg(4, card.bounds_buf);
+        card.krnl_preprocess.setArg(5, card.thresholds_buf);
+
+        // Map host-side buffer memory to user-space pointers
+        card.bounds = (int *)card.q.enqueueMapBuffer(card.bounds_buf, CL_TRUE, CL_MAP_WRITE, 0, sizeof(int) * 2 * NUM_WINDOWS);
+        card.thresholds = (int32_t *)card.q.enqueueMapBuffer(card.thresholds_buf, CL_TRUE, CL_MAP_WRITE, 0, sizeof(int32_t) * NUM_CHANNELS);
+
+        card.ped_generation = 0;
+        upload_peds(card.q, card.ped_tables_buf, card.ped_generation, state.staged_peds[0]);
+    }
 
-    // Schedule transfer of inputs to device memory, execution of kernel, and transfer of outputs back to host memory
-    q.enqueueMigrateMemObjects({data_packet_buf, all_peds_buf, bounds_buf}, 0 /* 0 means from host*/); // Send data from host to FPGA
-    q.enqueueTask(krnl_preprocess); // Run this kernel (add to task queue)
-    q.enqueueMigrateMemObjects({output_integrals_buf}, CL_MIGRATE_MEM_OBJECT_HOST); // Fetching data from FGPA to host
+    // Packets and outputs live in pinned, page-aligned pool slots that the
+    // device uses in place. Readers decode straight into a slot, and a slot
+    // is recycled after its output is written. A lane's slots are wrapped
+    // in buffers of its card's context.
+    state.num_lanes = NUM_READERS * state.cards.size();
+    const int num_batches = state.num_lanes * SLOTS_PER_READER;
+    if (buffer_pool_init(&state.packet_pool, sizeof(struct SW_Data_Packet) * BATCH_SIZE, num_batches) != 0 ||
+        buffer_pool_init(&state.output_pool, batch_output_size, num_batches) != 0) {
+        return -1;
+    }
+    state.batches.resize(num_batches);
+    for (int b = 0; b < num_batches; b++) {
+        Batch &batch = state.batches[b];
+        batch.lane = b % state.num_lanes;
+        Card &card = state.cards[batch.lane % state.cards.size()];
+        batch.packets = (struct SW_Data_Packet *) buffer_pool_slot(&state.packet_pool, buffer_pool_acquire(&state.packet_pool));
+        batch.output = (int32_t *) buffer_pool_slot(&state.output_pool, buffer_pool_acquire(&state.output_pool));
+        batch.packets_buf = cl::Buffer(card.context, CL_MEM_USE_HOST_PTR | CL_MEM_READ_ONLY, sizeof(struct SW_Data_Packet) * BATCH_SIZE, batch.packets, &err);
+        batch.output_buf = cl::Buffer(card.context, CL_MEM_USE_HOST_PTR | CL_MEM_WRITE_ONLY, batch_output_size, batch.output, &err);
+    }
+
+    Pipeline_Metrics &metrics = state.metrics;
+    metrics.started = std::chrono::steady_clock::now();
+    metrics.readers = std::vector<Thread_Metrics>(state.num_lanes);
+    metrics.dispatchers = std::vector<Thread_Metrics>(state.cards.size());
+    metrics.missed_triggers = 0;
+    for (int code = 0; code < METRICS_STATUS_CODES; code++) {
+        metrics.status_counts[code] = 0;
+    }
+    metrics.jobs_started = 0;
+    metrics.jobs_finished = 0;
+    metrics.free_rings = NULL;
+    metrics.filled_rings = NULL;
+    metrics.done_rings = NULL;
 
-    // Wait for all scheduled operations to finish
-    q.finish();
+    signal(SIGHUP, request_peds_reload);
+    signal(SIGUSR1, request_histogram_snapshot);
+    return 0;
+}
+
+void release_device(Device_State &state) {
+    state.batches.clear(); // Release the device buffers before their memory
+    buffer_pool_destroy(&state.packet_pool);
+    buffer_pool_destroy(&state.output_pool);
+}
+
+/*
+ Card d takes lanes d, d + num_cards, ... round-robin, which are its
+ chunks in file order. Pedestal swaps happen between batches: the first
+ card's dispatcher re-reads the file, once every card has the current
+ generation, and each card uploads a new generation before its next batch.
+ Cards switch at slightly different chunks, and every event records the
+ generation it was subtracted with.
+*/
+void dispatch_thread(Device_State * state, int d, Histogram_Monitor * monitor, Batch_Ring * filled_rings, Batch_Ring * done_rings) {
+    Card &card = state->cards[d];
+    Thread_Metrics &metrics = state->metrics.dispatchers[d];
+    const int num_cards = state->cards.size();
+    std::unique_ptr<struct Histogram_Fill> fill;
+    auto last_merge = std::chrono::steady_clock::now();
+    if (monitor != NULL) {
+        fill.reset(new struct Histogram_Fill);
+        histogram_fill_clear(fill.get());
+    }
+    int end_of_stream = 0;
+    int l = d;
+    while (!end_of_stream) {
+        Batch * batch = filled_rings[l].pop();
+        end_of_stream = batch->end_of_stream;
+        int lane = l;
+        if (!batch->chunk_continues) {
+            l = (l + num_cards < state->num_lanes) ? l + num_cards : d;
+        }
+
+        unsigned int generation = state->ped_generation.load(std::memory_order_acquire);
+        if (d == 0 && peds_reload_requested) {
+            int cards_current = 1;
+            for (int c = 0; c < num_cards; c++) {
+                cards_current &= (__atomic_load_n(&state->cards[c].ped_generation, __ATOMIC_ACQUIRE) == generation);
+            }
+            if (cards_current) {
+                peds_reload_requested = 0;
+                // A bad file only spoils the unused staging slot, the cards keep the current generation
+                if (load_peds(state->peds_file, state->staged_peds[(generation + 1) % 2]) == 0) {
+                    generation += 1;
+                    state->ped_generation.store(generation, std::memory_order_release);
+                }
+                else {
+                    std::cout << "ERROR: Pedestal reload failed, keeping generation " << generation << std::endl;
+                }
+            }
+        }
+        if (card.ped_generation != generation) {
+            upload_peds(card.q, card.ped_tables_buf, generation, state->staged_peds[generation % 2]);
+            // Published last, the first card reuses the staging slot once every card has moved on
+            __atomic_store_n(&card.ped_generation, generation, __ATOMIC_RELEASE);
+            std::cout << "INFO: Pedestal generation " << generation << " uploaded to card " << d << std::endl;
+        }
+
+        if (batch->num_packets > 0) {
+            auto started = std::chrono::steady_clock::now();
+
+            // Set kernel arguments
+            card.krnl_preprocess.setArg(0, batch->packets_buf);
+            card.krnl_preprocess.setArg(1, batch->num_packets);
+            card.krnl_preprocess.setArg(3, generation);
+            card.krnl_preprocess.setArg(6, batch->output_buf);
+
+            // Schedule transfer of inputs to device memory, execution of kernel, and transfer of outputs back to host memory
+            card.q.enqueueMigrateMemObjects({batch->packets_buf}, 0 /* 0 means from host*/); // Send data from host to FPGA
+            card.q.enqueueTask(card.krnl_preprocess); // Run this kernel (add to task queue)
+
+            // Fetch the batch header first, then only as many words as the sparse records used.
+            // The reads land in the slot the buffer already wraps.
+            card.q.enqueueReadBuffer(batch->output_buf, CL_TRUE, 0, sizeof(int32_t) * OUTPUT_HEADER_WORDS, batch->output);
+            int output_words = batch->output[1];
+            card.q.enqueueReadBuffer(batch->output_buf, CL_TRUE, sizeof(int32_t) * OUTPUT_HEADER_WORDS,
+                                     sizeof(int32_t) * (output_words - OUTPUT_HEADER_WORDS), batch->output + OUTPUT_HEADER_WORDS);
+
+            uint64_t busy_ns = nanoseconds_since(started);
+            card.num_batches += 1;
+            card.num_events += batch->num_packets;
+            card.busy_ns += busy_ns;
+            metric_add(metrics.events, batch->num_packets);
+            metric_batch(metrics, busy_ns);
+
+            // The output is still in cache, histogram it here rather than in the writer
+            if (monitor != NULL) {
+                histogram_batch(fill.get(), &monitor->totals.binning, batch->output, batch->num_packets, batch->packets);
+                if (std::chrono::steady_clock::now() - last_merge >= std::chrono::milliseconds(HIST_MERGE_MILLISECONDS)) {
+                    merge_histograms(monitor, fill.get());
+                    last_merge = std::chrono::steady_clock::now();
+                }
+            }
+        }
+        if (end_of_stream && monitor != NULL) {
+            merge_histograms(monitor, fill.get());
+        }
+
+        // ------------------------------------------------------------------------------------
+        // Step 4: Check Results
+        // ------------------------------------------------------------------------------------
+        done_rings[lane].push(batch);
+    }
+}
+
+// Runs one run file through the pipeline. Returns 0 on success and the
+// number of events written in num_events.
+int run_job(Device_State &state, const Job &job, uint64_t * num_events) {
+    *num_events = 0;
+    int data_packet_fd = open(job.data_file, O_RDONLY);
+    if (data_packet_fd == -1) {
+        perror("open");
+        return -1;
+    }
+    int output_fd = open(job.output_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (output_fd == -1) {
+        perror("open");
+        close(data_packet_fd);
+        return -1;
+    }
+    const int num_cards = state.cards.size();
+    Card &first_card = state.cards[0];
+
+    // Window labels for the text output
+    char bounds_text[2*NUM_WINDOWS][12];
+    char * bounds_strings[2*NUM_WINDOWS];
+    for (int i = 0; i < 2*NUM_WINDOWS; i++) {
+        first_card.bounds[i] = job.bounds[i];
+        sprintf(bounds_text[i], "%d", job.bounds[i]);
+        bounds_strings[i] = bounds_text[i];
+    }
+
+    // Without a thresholds file every channel is kept
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        first_card.thresholds[j] = INT32_MIN;
+    }
+    if (job.thresholds_file != NULL) {
+        int thresholds_fd = open(job.thresholds_file, 0, "r");
+        if (thresholds_fd == -1) {
+            perror("open");
+        }
+        else {
+            thresholds_dat_to_array(thresholds_fd, first_card.thresholds);
+        }
+    }
+
+    for (int d = 0; d < num_cards; d++) {
+        Card &card = state.cards[d];
+        memcpy(card.bounds, first_card.bounds, sizeof(int) * 2 * NUM_WINDOWS);
+        memcpy(card.thresholds, first_card.thresholds, sizeof(int32_t) * NUM_CHANNELS);
+        card.q.enqueueMigrateMemObjects({card.bounds_buf, card.thresholds_buf}, 0 /* 0 means from host*/);
+        card.num_batches = 0;
+        card.num_events = 0;
+        card.busy_ns = 0;
+    }
 
     // ------------------------------------------------------------------------------------
-    // Step 4: Check Results and Release Allocated Resources
+    // Step 3: Run the kernel, one batch of packets at a time
     // ------------------------------------------------------------------------------------
+    std::vector<Batch_Ring> free_rings(state.num_lanes);
+    std::vector<Batch_Ring> filled_rings(state.num_lanes);
+    std::vector<Batch_Ring> done_rings(state.num_lanes);
+    for (size_t b = 0; b < state.batches.size(); b++) {
+        free_rings[state.batches[b].lane].push(&state.batches[b]);
+    }
+    Pipeline_Metrics &metrics = state.metrics;
+    {
+        std::lock_guard<std::mutex> guard(metrics.rings_lock);
+        metrics.free_rings = free_rings.data();
+        metrics.filled_rings = filled_rings.data();
+        metrics.done_rings = done_rings.data();
+    }
+    metric_add(metrics.jobs_started, 1);
+
+    auto started = std::chrono::steady_clock::now();
+    // One per lane, and the last for the writer
+    std::vector<struct Framer_Stats> framer_stats(state.num_lanes + 1);
+    memset(framer_stats.data(), 0, sizeof(struct Framer_Stats) * framer_stats.size());
+    std::vector<std::thread> readers;
+    for (int l = 0; l < state.num_lanes; l++) {
+        readers.push_back(std::thread(reader_thread, l, state.num_lanes, data_packet_fd, &free_rings[l], &filled_rings[l],
+                                      &framer_stats[l], &metrics.readers[l]));
+    }
+    struct Archive_Writer archive;
+    int archive_fd = -1;
+    if (job.archive_file != NULL) {
+        archive_fd = open(job.archive_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+        if (archive_fd == -1) {
+            perror("open");
+        }
+        else if (archive_writer_open(&archive, archive_fd, first_card.bounds) != 0) {
+            close(archive_fd);
+            archive_fd = -1;
+        }
+    }
+    std::unique_ptr<Histogram_Monitor> monitor;
+    if (job.histogram_file != NULL) {
+        monitor.reset(new Histogram_Monitor);
+        monitor->snapshot_file = job.histogram_file;
+        histograms_init(&monitor->totals, &job.binning);
+    }
+    uint64_t json_seen = (state.json != NULL) ? state.json->num_seen : 0;
+    uint64_t json_exported = (state.json != NULL) ? state.json->num_exported : 0;
+    std::thread writer(writer_thread, output_fd, bounds_strings, (archive_fd == -1) ? NULL : &archive, monitor.get(),
+                       state.json, done_rings.data(), free_rings.data(), state.num_lanes, &framer_stats[state.num_lanes],
+                       &metrics);
+    std::vector<std::thread> dispatchers;
+    for (int d = 0; d < num_cards; d++) {
+        dispatchers.push_back(std::thread(dispatch_thread, &state, d, monitor.get(), filled_rings.data(), done_rings.data()));
+    }
+
+    for (int d = 0; d < num_cards; d++) {
+        dispatchers[d].join();
+    }
+    for (int l = 0; l < state.num_lanes; l++) {
+        readers[l].join();
+    }
+    writer.join();
+    {
+        std::lock_guard<std::mutex> guard(metrics.rings_lock);
+        metrics.free_rings = NULL;
+        metrics.filled_rings = NULL;
+        metrics.done_rings = NULL;
+    }
+    metric_add(metrics.jobs_finished, 1);
+    double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - started).count();
+    if (archive_fd != -1) {
+        archive_writer_close(&archive);
+        close(archive_fd);
+    }
+    if (monitor) {
+        write_histogram_snapshot(monitor.get());
+    }
+    // Each job's lines are complete in the file once it returns
+    if (state.json != NULL) {
+        json_exporter_flush(state.json);
+        printf("INFO: json  %lu of %lu packets exported\n", (unsigned long) (state.json->num_exported - json_exported),
+               (unsigned long) (state.json->num_seen - json_seen));
+    }
+    close(data_packet_fd);
+    close(output_fd);
+
+    // Busy time close to the elapsed time means the card is the bottleneck
+    for (int d = 0; d < num_cards; d++) {
+        Card &card = state.cards[d];
+        *num_events += card.num_events;
+        printf("INFO: card %d  %lu events in %lu batches, busy %.3f ms of %.3f ms, %.0f events/s\n",
+               d, (unsigned long) card.num_events, (unsigned long) card.num_batches,
+               card.busy_ns / 1e6, elapsed * 1e3, elapsed > 0 ? card.num_events / elapsed : 0.0);
+    }
+
+    struct Framer_Stats framed = {0, 0, 0};
+    for (int l = 0; l <= state.num_lanes; l++) {
+        framed.num_frames += framer_stats[l].num_frames;
+        framed.num_bad += framer_stats[l].num_bad;
+        framed.skipped_bytes += framer_stats[l].skipped_bytes;
+    }
+    printf("INFO: framer  %lu packets, %lu bad frames, %lu bytes skipped resynchronizing\n",
+           (unsigned long) framed.num_frames, (unsigned long) framed.num_bad, (unsigned long) framed.skipped_bytes);
+
+    // A full ring means its consumer is the bottleneck, an empty one its producer
+    char ring_name[32];
+    for (int l = 0; l < state.num_lanes; l++) {
+        sprintf(ring_name, "free[%d]", l);
+        free_rings[l].print_stats(ring_name);
+        sprintf(ring_name, "filled[%d]", l);
+        filled_rings[l].print_stats(ring_name);
+        sprintf(ring_name, "done[%d]", l);
+        done_rings[l].print_stats(ring_name);
+    }
+    return 0;
+}
+
+/*
+ Daemon mode: the device stays programmed and the buffers and pedestals
+ stay resident, and jobs arrive over a Unix socket (see
+ preprocess_daemon.h). SIGINT or SIGTERM stops it between jobs.
+*/
+volatile sig_atomic_t daemon_stop_requested = 0;
+
+void request_daemon_stop(int signum) {
+    daemon_stop_requested = 1;
+}
 
-    produce_output(bounds_strings, output_integrals, input_data_packet);
+int read_full(int fd, void * buf, size_t count) {
+    uint8_t * p = (uint8_t *) buf;
+    while (count > 0) {
+        ssize_t n = read(fd, p, count);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        count -= n;
+    }
+    return 0;
+}
+
+uint64_t microseconds_since(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+int serve(Device_State &state, const char * socket_path) {
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listen_fd, 16) == -1) {
+        perror("bind");
+        close(listen_fd);
+        return -1;
+    }
+
+    // No SA_RESTART, so a stop signal interrupts accept()
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = request_daemon_stop;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+    // A client that hangs up before its reply fails the write, not the daemon
+    struct sigaction ignore_action;
+    memset(&ignore_action, 0, sizeof(ignore_action));
+    ignore_action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore_action, NULL);
+
+    std::cout << "INFO: Serving on " << socket_path << std::endl;
+    while (!daemon_stop_requested) {
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd == -1) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        auto accepted = std::chrono::steady_clock::now();
+        // And one that sends nothing doesn't hold up the jobs behind it
+        struct timeval request_timeout = {DAEMON_REQUEST_SECONDS, 0};
+        if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &request_timeout, sizeof(request_timeout)) == -1) {
+            perror("setsockopt");
+        }
+
+        struct Job_Request request;
+        struct Job_Reply reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.magic = DAEMON_MAGIC;
+        if (read_full(client_fd, &request, sizeof(request)) != 0 || request.magic != DAEMON_MAGIC) {
+            printf("Malformed job request.\n");
+            reply.status = -2;
+        }
+        else {
+            request.data_file[DAEMON_PATH_BYTES-1] = '\0';
+            request.output_file[DAEMON_PATH_BYTES-1] = '\0';
+            request.thresholds_file[DAEMON_PATH_BYTES-1] = '\0';
+            request.archive_file[DAEMON_PATH_BYTES-1] = '\0';
+            request.histogram_file[DAEMON_PATH_BYTES-1] = '\0';
+            request.binning_file[DAEMON_PATH_BYTES-1] = '\0';
+            Job job;
+            job.data_file = request.data_file;
+            job.output_file = request.output_file;
+            job.thresholds_file = request.thresholds_file[0] ? request.thresholds_file : NULL;
+            job.archive_file = request.archive_file[0] ? request.archive_file : NULL;
+            job.histogram_file = request.histogram_file[0] ? request.histogram_file : NULL;
+            histogram_default_binning(&job.binning);
+            for (int i = 0; i < 2*NUM_WINDOWS; i++) {
+                job.bounds[i] = request.bounds[i];
+            }
+            reply.queue_us = microseconds_since(accepted);
+            auto started = std::chrono::steady_clock::now();
+            if (request.binning_file[0] && histogram_binning_from_file(request.binning_file, &job.binning) != 0) {
+                reply.status = -1;
+            }
+            else {
+                reply.status = run_job(state, job, &reply.num_events);
+            }
+            reply.run_us = microseconds_since(started);
+        }
+        if (write(client_fd, &reply, sizeof(reply)) != sizeof(reply)) {
+            perror("write");
+        }
+        close(client_fd);
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
+
+/*
+ --metrics <prom_file> <shm_name>: a publisher thread sums the threads'
+ metrics every METRICS_INTERVAL_MILLISECONDS, renames a fresh Prometheus
+ text file over prom_file (for the node exporter's textfile collector,
+ say) and copies the snapshot into the shared-memory object shm_name
+ (see metrics-monitor.c). It publishes once more on the way out, and the
+ object is removed when the host exits.
+*/
+struct Metrics_Publisher {
+    const char * prom_file;
+    const char * shm_name;
+    struct Metrics_Snapshot * shared;
+    std::atomic<bool> stop;
+    std::thread thread;
+};
+
+static inline void add_latency(struct Metrics_Latency * latency, Thread_Metrics &metrics) {
+    latency->count += metrics.batches.load(std::memory_order_relaxed);
+    latency->total_ns += metrics.busy_ns.load(std::memory_order_relaxed);
+    latency->max_ns = std::max(latency->max_ns, (uint64_t) metrics.max_ns.exchange(0, std::memory_order_relaxed));
+}
+
+void collect_metrics(Device_State &state, struct Metrics_Snapshot * s) {
+    Pipeline_Metrics &metrics = state.metrics;
+    memset(s, 0, sizeof(*s));
+    s->magic = METRICS_MAGIC;
+    s->version = METRICS_VERSION;
+    s->published_unix_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    s->uptime_ms = nanoseconds_since(metrics.started) / 1000000;
+    s->num_lanes = std::min(state.num_lanes, METRICS_MAX_LANES);
+    s->num_cards = std::min((int) state.cards.size(), METRICS_MAX_CARDS);
+    s->jobs_started = metrics.jobs_started.load(std::memory_order_relaxed);
+    s->jobs_finished = metrics.jobs_finished.load(std::memory_order_relaxed);
+    s->job_running = (s->jobs_started != s->jobs_finished);
+
+    for (int l = 0; l < state.num_lanes; l++) {
+        Thread_Metrics &reader = metrics.readers[l];
+        s->events_in += reader.events.load(std::memory_order_relaxed);
+        s->bytes_in += reader.bytes.load(std::memory_order_relaxed);
+        s->bad_frames += reader.bad_frames.load(std::memory_order_relaxed);
+        s->skipped_bytes += reader.skipped_bytes.load(std::memory_order_relaxed);
+        add_latency(&s->stages[METRICS_STAGE_READ], reader);
+    }
+    for (size_t d = 0; d < state.cards.size(); d++) {
+        Thread_Metrics &dispatcher = metrics.dispatchers[d];
+        if (d < s->num_cards) {
+            s->card_events[d] = dispatcher.events.load(std::memory_order_relaxed);
+            s->card_busy_ns[d] = dispatcher.busy_ns.load(std::memory_order_relaxed);
+        }
+        add_latency(&s->stages[METRICS_STAGE_DEVICE], dispatcher);
+    }
+    s->events_out = metrics.writer.events.load(std::memory_order_relaxed);
+    s->bytes_out = metrics.writer.bytes.load(std::memory_order_relaxed);
+    s->bad_frames += metrics.writer.bad_frames.load(std::memory_order_relaxed);
+    s->skipped_bytes += metrics.writer.skipped_bytes.load(std::memory_order_relaxed);
+    add_latency(&s->stages[METRICS_STAGE_WRITE], metrics.writer);
+    add_latency(&s->stages[METRICS_STAGE_PIPELINE], metrics.pipeline);
+    s->missed_triggers = metrics.missed_triggers.load(std::memory_order_relaxed);
+    for (int code = 0; code < METRICS_STATUS_CODES; code++) {
+        s->status_counts[code] = metrics.status_counts[code].load(std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> guard(metrics.rings_lock);
+    if (metrics.free_rings != NULL) {
+        for (uint32_t l = 0; l < s->num_lanes; l++) {
+            s->free_depth[l] = metrics.free_rings[l].depth();
+            s->filled_depth[l] = metrics.filled_rings[l].depth();
+            s->done_depth[l] = metrics.done_rings[l].depth();
+        }
+    }
+}
+
+// Written next to the metrics file and renamed over it, like the histogram snapshots
+int write_metrics_file(const char * prom_file, const struct Metrics_Snapshot * snapshot) {
+    std::string tmp_file = std::string(prom_file) + ".tmp";
+    FILE * fp = fopen(tmp_file.c_str(), "w");
+    if (fp == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    int status = metrics_write_prometheus(snapshot, fp);
+    if (fclose(fp) != 0 || status != 0 || rename(tmp_file.c_str(), prom_file) != 0) {
+        perror("metrics");
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_thread(Device_State * state, Metrics_Publisher * publisher) {
+    struct Metrics_Snapshot snapshot;
+    auto next_publish = std::chrono::steady_clock::now();
+    for (;;) {
+        int stopping = publisher->stop.load(std::memory_order_acquire);
+        if (stopping || std::chrono::steady_clock::now() >= next_publish) {
+            collect_metrics(*state, &snapshot);
+            write_metrics_file(publisher->prom_file, &snapshot);
+            metrics_publish(publisher->shared, &snapshot);
+            next_publish += std::chrono::milliseconds(METRICS_INTERVAL_MILLISECONDS);
+        }
+        if (stopping) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(std::min(METRICS_INTERVAL_MILLISECONDS, 50)));
+    }
+}
+
+int start_metrics(Device_State &state, Metrics_Publisher &publisher) {
+    publisher.shared = metrics_shm_create(publisher.shm_name);
+    if (publisher.shared == NULL) {
+        return -1;
+    }
+    publisher.stop = false;
+    publisher.thread = std::thread(metrics_thread, &state, &publisher);
+    std::cout << "INFO: Publishing metrics to " << publisher.prom_file << " and shared memory " << publisher.shm_name << std::endl;
+    return 0;
+}
+
+void stop_metrics(Metrics_Publisher &publisher) {
+    publisher.stop.store(true, std::memory_order_release);
+    publisher.thread.join();
+    metrics_shm_close(publisher.shared);
+    shm_unlink(publisher.shm_name);
+}
+
+// A whole decimal number from 0 to 65535
+int parse_trigger_number(const char * text, uint16_t * trigger_number) {
+    char * end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || value < 0 || value > UINT16_MAX) {
+        return -1;
+    }
+    *trigger_number = value;
+    return 0;
+}
+
+// ------------------------------------------------------------------------------------
+// Main program
+// ------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+    static Device_State state; // Holds the staged pedestal table, too big for the stack
+    const char * peds_file = "../../src/peds.dat";
+
+    // Optional, in any order, and taken off the front so the rest parses as before
+    static Metrics_Publisher metrics;
+    metrics.prom_file = NULL;
+    // --json <json_file> <prescale> <first_trigger> <last_trigger>, one file for all jobs
+    static struct Json_Exporter json;
+    int json_fd = -1;
+    state.json = NULL;
+    for (;;) {
+        if (argc >= 4 && strcmp(argv[1], "--metrics") == 0 && metrics.prom_file == NULL) {
+            metrics.prom_file = argv[2];
+            metrics.shm_name = argv[3];
+            argc -= 3;
+            argv += 3;
+        }
+        else if (argc >= 6 && strcmp(argv[1], "--json") == 0 && state.json == NULL) {
+            uint16_t first_trigger, last_trigger;
+            if (parse_trigger_number(argv[4], &first_trigger) != 0 || parse_trigger_number(argv[5], &last_trigger) != 0) {
+                printf("--json trigger numbers go from 0 to 65535.\n");
+                return EXIT_FAILURE;
+            }
+            json_fd = open(argv[2], O_CREAT | O_WRONLY | O_TRUNC, 0666);
+            if (json_fd == -1) {
+                perror("open");
+                return EXIT_FAILURE;
+            }
+            if (json_exporter_open(&json, json_fd, atoi(argv[3]), first_trigger, last_trigger) != 0) {
+                return EXIT_FAILURE;
+            }
+            state.json = &json;
+            argc -= 5;
+            argv += 5;
+        }
+        else {
+            break;
+        }
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--daemon") == 0) {
+        std::string binaryFile = (argc < 4) ? "preprocess.xclbin" : argv[3]; // COMPILED BINARY
+        if (setup_device(state, binaryFile, peds_file) != 0) {
+            return EXIT_FAILURE;
+        }
+        if (metrics.prom_file != NULL && start_metrics(state, metrics) != 0) {
+            return EXIT_FAILURE;
+        }
+        int status = serve(state, argv[2]);
+        if (metrics.prom_file != NULL) {
+            stop_metrics(metrics);
+        }
+        if (state.json != NULL) {
+            json_exporter_close(state.json);
+            close(json_fd);
+        }
+        release_device(state);
+        return (status == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    std::string binaryFile = (argc < 2) ? "preprocess.xclbin" : argv[1]; // COMPILED BINARY
+    Job job;
+    job.data_file = "../../src/EventStream.dat";
+    job.output_file = "output.txt";
+    job.thresholds_file = (argc < 3) ? NULL : argv[2]; // Zero-suppression thresholds, one per channel
+    job.archive_file = (argc < 4) ? NULL : argv[3]; // Compressed copy of the results, see integral_archive.h
+    job.histogram_file = (argc < 5) ? NULL : argv[4]; // Integral spectra snapshots, see integral_histogram.h
+    histogram_default_binning(&job.binning);
+    if (argc >= 6 && histogram_binning_from_file(argv[5], &job.binning) != 0) { // One "low shift" line per window
+        return EXIT_FAILURE;
+    }
+    const int default_bounds[2*NUM_WINDOWS] = {-5, 5, -10, 10, -15, 15, -20, 20};
+    for (int i = 0; i < 2*NUM_WINDOWS; i++) {
+        job.bounds[i] = default_bounds[i];
+    }
+
+    if (setup_device(state, binaryFile, peds_file) != 0) {
+        return EXIT_FAILURE;
+    }
+    if (metrics.prom_file != NULL && start_metrics(state, metrics) != 0) {
+        return EXIT_FAILURE;
+    }
+    uint64_t num_events;
+    int status = run_job(state, job, &num_events);
+    if (metrics.prom_file != NULL) {
+        stop_metrics(metrics);
+    }
+    if (state.json != NULL) {
+        json_exporter_close(state.json);
+        close(json_fd);
+    }
+    release_device(state);
+    return (status == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 
     /*bool match = true;
     for (int i = 0; i < DATA_SIZE; i++)
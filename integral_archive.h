@@ -0,0 +1,484 @@
+#ifndef INTEGRAL_ARCHIVE_H
+#define INTEGRAL_ARCHIVE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "preprocess.h"
+
+/*
+ Compact archive of the per-event results (header fields and the sparse
+ record). Values are delta encoded per channel and stored as zigzag
+ varints:
+   - window 0 against the same channel's window 0 in the previous event
+     that kept the channel,
+   - windows 1.. against the next narrower window of the same event (the
+     windows are nested, so this is the sum over the extra samples),
+   - pulse features against the previous event, like window 0,
+   - trigger number, coarse time and pedestal generation against the
+     previous event.
+ Events are grouped in chunks of ARCHIVE_CHUNK_EVENTS that decode
+ independently. An index of chunks at the end of the file gives random
+ access by event number.
+
+ File layout: Archive_File_Header, chunk payloads, Archive_Chunk_Index
+ per chunk, Archive_Trailer.
+*/
+#define ARCHIVE_MAGIC 0x41544e49 // "INTA"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_CHUNK_EVENTS 4096
+#define ARCHIVE_HEADER_FIELDS 14 // Per-event header values including the channel mask, see archive_encode_event
+#define ARCHIVE_MAX_EVENT_BYTES (10 * (ARCHIVE_HEADER_FIELDS + SPARSE_RECORD_MAX_WORDS)) // Worst case, 10 bytes per varint
+
+struct Archive_File_Header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t num_channels;
+    uint16_t num_windows;
+    uint16_t num_features;
+    uint32_t chunk_events;
+    int32_t bounds[2*NUM_WINDOWS]; // Trigger-relative window bounds, for labelling
+};
+
+struct Archive_Chunk_Index {
+    uint64_t first_event;
+    uint64_t offset;
+    uint32_t num_events;
+    uint32_t payload_bytes;
+};
+
+struct Archive_Trailer {
+    uint64_t index_offset;
+    uint64_t num_events;
+    uint32_t num_chunks;
+    uint32_t magic;
+};
+
+// One event, with the output header fields and its sparse record
+struct Archive_Event {
+    uint8_t i2c_address;
+    uint8_t conf_address;
+    uint8_t bank;
+    uint8_t fine_time;
+    uint32_t coarse_time;
+    uint16_t trigger_number;
+    uint8_t samples_after_trigger;
+    uint8_t look_back_samples;
+    uint8_t samples_to_be_read;
+    uint8_t starting_sample_number;
+    uint8_t number_of_missed_triggers;
+    uint8_t state_machine_status;
+    uint32_t ped_generation;
+    int32_t record[SPARSE_RECORD_MAX_WORDS]; // Channel mask, then CHANNEL_WORDS per kept channel
+};
+
+// Delta state, reset at the start of every chunk
+struct Archive_State {
+    uint32_t coarse_time;
+    uint16_t trigger_number;
+    uint32_t ped_generation;
+    int32_t prev[NUM_CHANNELS][CHANNEL_WORDS]; // Last kept values per channel
+};
+
+static inline uint64_t zigzag_encode(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static inline uint8_t * varint_put(uint8_t * p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t) v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t) v;
+    return p;
+}
+
+// Returns NULL if the varint runs past end.
+static inline const uint8_t * varint_get(const uint8_t * p, const uint8_t * end, uint64_t * v) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        result |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *v = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static inline void archive_reset_state(struct Archive_State * state) {
+    memset(state, 0, sizeof(*state));
+}
+
+// Writes at most ARCHIVE_MAX_EVENT_BYTES and returns the end of the encoding.
+static inline uint8_t * archive_encode_event(struct Archive_State * state, const struct Archive_Event * event, uint8_t * p) {
+    p = varint_put(p, event->i2c_address);
+    p = varint_put(p, event->conf_address);
+    p = varint_put(p, event->bank);
+    p = varint_put(p, event->fine_time);
+    p = varint_put(p, zigzag_encode((int64_t) event->coarse_time - state->coarse_time));
+    p = varint_put(p, zigzag_encode((int64_t) event->trigger_number - state->trigger_number));
+    p = varint_put(p, event->samples_after_trigger);
+    p = varint_put(p, event->look_back_samples);
+    p = varint_put(p, event->samples_to_be_read);
+    p = varint_put(p, event->starting_sample_number);
+    p = varint_put(p, event->number_of_missed_triggers);
+    p = varint_put(p, event->state_machine_status);
+    p = varint_put(p, zigzag_encode((int64_t) event->ped_generation - state->ped_generation));
+    p = varint_put(p, (uint32_t) event->record[0]);
+    state->coarse_time = event->coarse_time;
+    state->trigger_number = event->trigger_number;
+    state->ped_generation = event->ped_generation;
+
+    uint32_t mask = event->record[0];
+    const int32_t * values = event->record + 1;
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        if (!(mask & (1 << j))) {
+            continue;
+        }
+        int32_t * prev = state->prev[j];
+        p = varint_put(p, zigzag_encode((int64_t) values[0] - prev[0]));
+        for (int w = 1; w < NUM_WINDOWS; w++) {
+            p = varint_put(p, zigzag_encode((int64_t) values[w] - values[w-1]));
+        }
+        for (int f = NUM_WINDOWS; f < CHANNEL_WORDS; f++) {
+            p = varint_put(p, zigzag_encode((int64_t) values[f] - prev[f]));
+        }
+        memcpy(prev, values, sizeof(int32_t) * CHANNEL_WORDS);
+        values += CHANNEL_WORDS;
+    }
+    return p;
+}
+
+// Returns the end of the event's encoding, or NULL if the data is corrupt.
+static inline const uint8_t * archive_decode_event(struct Archive_State * state, const uint8_t * p, const uint8_t * end,
+                                                   struct Archive_Event * event) {
+    uint64_t v[ARCHIVE_HEADER_FIELDS];
+    for (int i = 0; i < ARCHIVE_HEADER_FIELDS; i++) {
+        if ((p = varint_get(p, end, &v[i])) == NULL) {
+            return NULL;
+        }
+    }
+    event->i2c_address = v[0];
+    event->conf_address = v[1];
+    event->bank = v[2];
+    event->fine_time = v[3];
+    event->coarse_time = state->coarse_time + zigzag_decode(v[4]);
+    event->trigger_number = state->trigger_number + zigzag_decode(v[5]);
+    event->samples_after_trigger = v[6];
+    event->look_back_samples = v[7];
+    event->samples_to_be_read = v[8];
+    event->starting_sample_number = v[9];
+    event->number_of_missed_triggers = v[10];
+    event->state_machine_status = v[11];
+    event->ped_generation = state->ped_generation + zigzag_decode(v[12]);
+    event->record[0] = (int32_t) v[13];
+    state->coarse_time = event->coarse_time;
+    state->trigger_number = event->trigger_number;
+    state->ped_generation = event->ped_generation;
+
+    uint32_t mask = event->record[0];
+    int32_t * values = event->record + 1;
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        if (!(mask & (1 << j))) {
+            continue;
+        }
+        uint64_t d[CHANNEL_WORDS];
+        for (int i = 0; i < CHANNEL_WORDS; i++) {
+            if ((p = varint_get(p, end, &d[i])) == NULL) {
+                return NULL;
+            }
+        }
+        int32_t * prev = state->prev[j];
+        values[0] = (int32_t) (prev[0] + zigzag_decode(d[0]));
+        for (int w = 1; w < NUM_WINDOWS; w++) {
+            values[w] = (int32_t) (values[w-1] + zigzag_decode(d[w]));
+        }
+        for (int f = NUM_WINDOWS; f < CHANNEL_WORDS; f++) {
+            values[f] = (int32_t) (prev[f] + zigzag_decode(d[f]));
+        }
+        memcpy(prev, values, sizeof(int32_t) * CHANNEL_WORDS);
+        values += CHANNEL_WORDS;
+    }
+    return p;
+}
+
+static inline int write_all(int fd, const void * buf, size_t count) {
+    const uint8_t * p = (const uint8_t *) buf;
+    while (count > 0) {
+        ssize_t n = write(fd, p, count);
+        if (n == -1) {
+            perror("write");
+            return -1;
+        }
+        p += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static inline int pread_all(int fd, void * buf, size_t count, off_t offset) {
+    uint8_t * p = (uint8_t *) buf;
+    while (count > 0) {
+        ssize_t n = pread(fd, p, count, offset);
+        if (n <= 0) {
+            if (n == -1) {
+                perror("pread");
+            }
+            return -1;
+        }
+        p += n;
+        count -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ Writer. Events are encoded into an in-memory chunk, which is written out
+ when full. archive_writer_close writes the last chunk, the index and the
+ trailer. Without it the file has no index and can't be read.
+*/
+struct Archive_Writer {
+    int fd;
+    uint64_t offset; // Bytes written so far
+    uint64_t num_events;
+    struct Archive_State state;
+    uint8_t * chunk;
+    size_t chunk_bytes;
+    uint32_t chunk_events;
+    struct Archive_Chunk_Index * index;
+    uint32_t num_chunks;
+    uint32_t index_capacity;
+};
+
+static inline int archive_writer_open(struct Archive_Writer * writer, int fd, const int * bounds) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+    writer->chunk = (uint8_t *) malloc((size_t) ARCHIVE_CHUNK_EVENTS * ARCHIVE_MAX_EVENT_BYTES);
+    if (writer->chunk == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    struct Archive_File_Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ARCHIVE_MAGIC;
+    header.version = ARCHIVE_VERSION;
+    header.num_channels = NUM_CHANNELS;
+    header.num_windows = NUM_WINDOWS;
+    header.num_features = NUM_FEATURES;
+    header.chunk_events = ARCHIVE_CHUNK_EVENTS;
+    for (int i = 0; i < 2*NUM_WINDOWS; i++) {
+        header.bounds[i] = bounds[i];
+    }
+    writer->offset = sizeof(header);
+    return write_all(fd, &header, sizeof(header));
+}
+
+static inline int archive_flush_chunk(struct Archive_Writer * writer) {
+    if (writer->chunk_events == 0) {
+        return 0;
+    }
+    if (writer->num_chunks == writer->index_capacity) {
+        uint32_t capacity = writer->index_capacity ? 2*writer->index_capacity : 64;
+        struct Archive_Chunk_Index * index = (struct Archive_Chunk_Index *) realloc(writer->index, sizeof(*index) * capacity);
+        if (index == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        writer->index = index;
+        writer->index_capacity = capacity;
+    }
+    struct Archive_Chunk_Index * entry = &writer->index[writer->num_chunks++];
+    entry->first_event = writer->num_events - writer->chunk_events;
+    entry->offset = writer->offset;
+    entry->num_events = writer->chunk_events;
+    entry->payload_bytes = writer->chunk_bytes;
+    if (write_all(writer->fd, writer->chunk, writer->chunk_bytes) != 0) {
+        return -1;
+    }
+    writer->offset += writer->chunk_bytes;
+    writer->chunk_bytes = 0;
+    writer->chunk_events = 0;
+    archive_reset_state(&writer->state);
+    return 0;
+}
+
+static inline int archive_append(struct Archive_Writer * writer, const struct Archive_Event * event) {
+    uint8_t * end = archive_encode_event(&writer->state, event, writer->chunk + writer->chunk_bytes);
+    writer->chunk_bytes = end - writer->chunk;
+    writer->chunk_events++;
+    writer->num_events++;
+    if (writer->chunk_events == ARCHIVE_CHUNK_EVENTS) {
+        return archive_flush_chunk(writer);
+    }
+    return 0;
+}
+
+static inline int archive_writer_close(struct Archive_Writer * writer) {
+    int status = archive_flush_chunk(writer);
+    struct Archive_Trailer trailer;
+    trailer.index_offset = writer->offset;
+    trailer.num_events = writer->num_events;
+    trailer.num_chunks = writer->num_chunks;
+    trailer.magic = ARCHIVE_MAGIC;
+    if (status == 0) {
+        status = write_all(writer->fd, writer->index, sizeof(struct Archive_Chunk_Index) * writer->num_chunks);
+    }
+    if (status == 0) {
+        status = write_all(writer->fd, &trailer, sizeof(trailer));
+    }
+    free(writer->chunk);
+    free(writer->index);
+    writer->chunk = NULL;
+    writer->index = NULL;
+    return status;
+}
+
+/*
+ Reader. Keeps one decoded chunk position, so reading events in order
+ costs one event decode each, and a seek decodes from the chunk start.
+*/
+struct Archive_Reader {
+    int fd;
+    struct Archive_File_Header header;
+    struct Archive_Trailer trailer;
+    struct Archive_Chunk_Index * index;
+    uint8_t * chunk;
+    uint32_t chunk_idx; // Chunk held in chunk, num_chunks if none
+    const uint8_t * cursor;
+    uint64_t cursor_event; // Event the cursor decodes next
+    struct Archive_State state;
+};
+
+static inline void archive_reader_close(struct Archive_Reader * reader) {
+    free(reader->index);
+    free(reader->chunk);
+    reader->index = NULL;
+    reader->chunk = NULL;
+}
+
+// Chunks must cover the events in order with no gaps, each holding 1 to
+// chunk_events of them, and lie in order between the header and the index
+static inline int archive_index_valid(const struct Archive_Reader * reader) {
+    uint64_t next_event = 0;
+    uint64_t next_offset = sizeof(reader->header);
+    for (uint32_t c = 0; c < reader->trailer.num_chunks; c++) {
+        const struct Archive_Chunk_Index * entry = &reader->index[c];
+        if (entry->first_event != next_event || entry->num_events == 0 || entry->num_events > reader->header.chunk_events ||
+            entry->offset < next_offset || entry->payload_bytes > (uint64_t) entry->num_events * ARCHIVE_MAX_EVENT_BYTES ||
+            entry->offset > reader->trailer.index_offset || entry->payload_bytes > reader->trailer.index_offset - entry->offset) {
+            return 0;
+        }
+        next_event += entry->num_events;
+        next_offset = entry->offset + entry->payload_bytes;
+    }
+    return next_event == reader->trailer.num_events;
+}
+
+static inline int archive_reader_open(struct Archive_Reader * reader, int fd) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    off_t file_bytes = lseek(fd, 0, SEEK_END);
+    if (file_bytes < (off_t) (sizeof(reader->header) + sizeof(reader->trailer)) ||
+        pread_all(fd, &reader->header, sizeof(reader->header), 0) != 0 ||
+        pread_all(fd, &reader->trailer, sizeof(reader->trailer), file_bytes - sizeof(reader->trailer)) != 0) {
+        printf("Archive is truncated.\n");
+        return -1;
+    }
+    if (reader->header.magic != ARCHIVE_MAGIC || reader->trailer.magic != ARCHIVE_MAGIC || reader->header.version != ARCHIVE_VERSION) {
+        printf("Not an integral archive, or an unfinished one.\n");
+        return -2;
+    }
+    if (reader->header.num_channels != NUM_CHANNELS || reader->header.num_windows != NUM_WINDOWS || reader->header.num_features != NUM_FEATURES) {
+        printf("Archive was written for a different detector configuration.\n");
+        return -3;
+    }
+    // The index sits between the chunks and the trailer
+    uint64_t index_end = file_bytes - sizeof(reader->trailer);
+    uint64_t index_bytes = (uint64_t) sizeof(struct Archive_Chunk_Index) * reader->trailer.num_chunks;
+    if (reader->header.chunk_events == 0 || reader->header.chunk_events > ARCHIVE_CHUNK_EVENTS ||
+        (reader->trailer.num_chunks == 0 && reader->trailer.num_events != 0) ||
+        reader->trailer.index_offset < sizeof(reader->header) || reader->trailer.index_offset > index_end ||
+        index_bytes > index_end - reader->trailer.index_offset) {
+        printf("Archive index is corrupt.\n");
+        return -2;
+    }
+    reader->index = (struct Archive_Chunk_Index *) malloc(index_bytes ? index_bytes : 1);
+    if (reader->index == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (pread_all(fd, reader->index, index_bytes, reader->trailer.index_offset) != 0) {
+        printf("Archive index is truncated.\n");
+        archive_reader_close(reader);
+        return -1;
+    }
+    if (!archive_index_valid(reader)) {
+        printf("Archive index is corrupt.\n");
+        archive_reader_close(reader);
+        return -2;
+    }
+    reader->chunk = (uint8_t *) malloc((size_t) reader->header.chunk_events * ARCHIVE_MAX_EVENT_BYTES);
+    if (reader->chunk == NULL) {
+        perror("malloc");
+        archive_reader_close(reader);
+        return -1;
+    }
+    reader->chunk_idx = reader->trailer.num_chunks;
+    return 0;
+}
+
+static inline uint64_t archive_num_events(const struct Archive_Reader * reader) {
+    return reader->trailer.num_events;
+}
+
+// Reads event number event_idx. Returns 0, -1 past the end or -2 if corrupt.
+static inline int archive_read_event(struct Archive_Reader * reader, uint64_t event_idx, struct Archive_Event * event) {
+    if (event_idx >= reader->trailer.num_events) {
+        return -1;
+    }
+    const struct Archive_Chunk_Index * current = (reader->chunk_idx < reader->trailer.num_chunks) ? &reader->index[reader->chunk_idx] : NULL;
+    if (current == NULL || event_idx < reader->cursor_event || event_idx >= current->first_event + current->num_events) {
+        // Binary search for the last chunk starting at or before event_idx
+        uint32_t lo = 0, hi = reader->trailer.num_chunks;
+        while (hi - lo > 1) {
+            uint32_t mid = (lo + hi) / 2;
+            if (reader->index[mid].first_event <= event_idx) {
+                lo = mid;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        current = &reader->index[lo];
+        if (current->payload_bytes > (size_t) reader->header.chunk_events * ARCHIVE_MAX_EVENT_BYTES ||
+            pread_all(reader->fd, reader->chunk, current->payload_bytes, current->offset) != 0) {
+            return -2;
+        }
+        reader->chunk_idx = lo;
+        reader->cursor = reader->chunk;
+        reader->cursor_event = current->first_event;
+        archive_reset_state(&reader->state);
+    }
+    const uint8_t * end = reader->chunk + current->payload_bytes;
+    while (reader->cursor_event <= event_idx) {
+        reader->cursor = archive_decode_event(&reader->state, reader->cursor, end, event);
+        if (reader->cursor == NULL) {
+            reader->chunk_idx = reader->trailer.num_chunks;
+            return -2;
+        }
+        reader->cursor_event++;
+    }
+    return 0;
+}
+
+#endif // INTEGRAL_ARCHIVE_H
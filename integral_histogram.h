@@ -0,0 +1,150 @@
+#ifndef INTEGRAL_HISTOGRAM_H
+#define INTEGRAL_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "preprocess.h"
+
+/*
+ Per-channel integral spectra, one histogram per bank x window x channel.
+ Each window has its own binning: bins of 2^shift starting at low, plus an
+ underflow and an overflow bin. Power-of-two bins keep filling to a
+ subtract and a shift.
+
+ Fillers count into a private Histogram_Fill (32-bit counts, no sharing)
+ and periodically merge it into the shared Integral_Histograms (64-bit
+ totals), which is what snapshots are taken from.
+*/
+#define HIST_NUM_BANKS 2
+#define HIST_NUM_BINS 512 // Per histogram, not counting underflow and overflow
+#define HIST_ROW_BINS (HIST_NUM_BINS + 2) // Underflow, HIST_NUM_BINS bins, overflow
+#define HIST_NUM_ROWS (HIST_NUM_BANKS * NUM_WINDOWS * NUM_CHANNELS)
+
+struct Histogram_Binning {
+    int32_t low[NUM_WINDOWS]; // Lower edge of the first bin
+    int32_t shift[NUM_WINDOWS]; // Bins are 2^shift wide
+};
+
+struct Histogram_Fill {
+    uint32_t num_events;
+    uint32_t counts[HIST_NUM_ROWS][HIST_ROW_BINS];
+};
+
+struct Integral_Histograms {
+    struct Histogram_Binning binning;
+    uint64_t num_events;
+    uint64_t counts[HIST_NUM_ROWS][HIST_ROW_BINS];
+};
+
+static inline int histogram_row(int bank, int window, int channel) {
+    return (bank * NUM_WINDOWS + window) * NUM_CHANNELS + channel;
+}
+
+// A quarter of each range below zero, wider bins for the wider windows
+static inline void histogram_default_binning(struct Histogram_Binning * binning) {
+    for (int w = 0; w < NUM_WINDOWS; w++) {
+        binning->shift[w] = 4 + w;
+        binning->low[w] = -(HIST_NUM_BINS / 4) * (1 << binning->shift[w]);
+    }
+}
+
+// Reads one "low shift" line per window. Returns 0 on success.
+static inline int histogram_binning_from_file(const char * path, struct Histogram_Binning * binning) {
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    for (int w = 0; w < NUM_WINDOWS; w++) {
+        if (fscanf(fp, "%d %d", &binning->low[w], &binning->shift[w]) != 2 ||
+            binning->shift[w] < 0 || binning->shift[w] > 24) {
+            printf("Binning file must hold a low edge and a shift (0-24) for each of the %d windows.\n", NUM_WINDOWS);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static inline void histograms_init(struct Integral_Histograms * hist, const struct Histogram_Binning * binning) {
+    memset(hist, 0, sizeof(*hist));
+    hist->binning = *binning;
+}
+
+static inline void histogram_fill_clear(struct Histogram_Fill * fill) {
+    memset(fill, 0, sizeof(*fill));
+}
+
+// Counts the windows of one sparse record. Returns the number of words consumed.
+static inline int histogram_fill_record(struct Histogram_Fill * fill, const struct Histogram_Binning * binning,
+                                        int bank, const int32_t * record) {
+    uint32_t mask = record[0];
+    const int32_t * channel_words = record + 1;
+    int num_kept = 0;
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        if (mask & (1 << j)) {
+            for (int w = 0; w < NUM_WINDOWS; w++) {
+                int64_t offset = (int64_t) channel_words[w] - binning->low[w];
+                int bin;
+                if (offset < 0) {
+                    bin = 0;
+                }
+                else {
+                    int64_t b = offset >> binning->shift[w];
+                    bin = (b < HIST_NUM_BINS) ? (int) b + 1 : HIST_ROW_BINS - 1;
+                }
+                fill->counts[histogram_row(bank, w, j)][bin]++;
+            }
+            channel_words += CHANNEL_WORDS;
+            num_kept++;
+        }
+    }
+    fill->num_events++;
+    return 1 + num_kept*CHANNEL_WORDS;
+}
+
+// Adds fill into hist and clears fill
+static inline void histograms_merge(struct Integral_Histograms * hist, struct Histogram_Fill * fill) {
+    for (int r = 0; r < HIST_NUM_ROWS; r++) {
+        for (int b = 0; b < HIST_ROW_BINS; b++) {
+            hist->counts[r][b] += fill->counts[r][b];
+        }
+    }
+    hist->num_events += fill->num_events;
+    histogram_fill_clear(fill);
+}
+
+/*
+ Text snapshot: a comment header, then one line per histogram:
+   bank window channel low bin_width underflow bin_0 ... bin_N-1 overflow
+ Histograms that never counted anything are left out.
+*/
+static inline int histograms_write(const struct Integral_Histograms * hist, FILE * fp) {
+    fprintf(fp, "# events %lu\n", (unsigned long) hist->num_events);
+    fprintf(fp, "# bank window channel low bin_width underflow bins[%d] overflow\n", HIST_NUM_BINS);
+    for (int bank = 0; bank < HIST_NUM_BANKS; bank++) {
+        for (int w = 0; w < NUM_WINDOWS; w++) {
+            for (int j = 0; j < NUM_CHANNELS; j++) {
+                const uint64_t * row = hist->counts[histogram_row(bank, w, j)];
+                uint64_t total = 0;
+                for (int b = 0; b < HIST_ROW_BINS; b++) {
+                    total += row[b];
+                }
+                if (total == 0) {
+                    continue;
+                }
+                fprintf(fp, "%d %d %d %d %d", bank, w, j, hist->binning.low[w], 1 << hist->binning.shift[w]);
+                for (int b = 0; b < HIST_ROW_BINS; b++) {
+                    fprintf(fp, " %lu", (unsigned long) row[b]);
+                }
+                fprintf(fp, "\n");
+            }
+        }
+    }
+    return ferror(fp) ? -1 : 0;
+}
+
+#endif // INTEGRAL_HISTOGRAM_H
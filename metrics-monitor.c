@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "pipeline_metrics.h"
+
+// Average per batch over the interval, in milliseconds
+double interval_latency_ms(const struct Metrics_Latency * now, const struct Metrics_Latency * then) {
+    uint64_t count = now->count - then->count;
+    return count ? (now->total_ns - then->total_ns) / 1e6 / count : 0.0;
+}
+
+void print_rates(const struct Metrics_Snapshot * now, const struct Metrics_Snapshot * then) {
+    double seconds = (now->uptime_ms - then->uptime_ms) / 1e3;
+    if (seconds <= 0) {
+        return;
+    }
+    uint32_t filled = 0;
+    uint32_t done = 0;
+    for (uint32_t l = 0; l < now->num_lanes; l++) {
+        filled += now->filled_depth[l];
+        done += now->done_depth[l];
+    }
+    printf("%8.1f s  in %9.0f ev/s %7.1f MB/s  out %9.0f ev/s  bad %lu  missed %lu  "
+           "ms/batch read %.2f device %.2f write %.2f pipeline %.2f  queued filled %u done %u%s\n",
+           now->uptime_ms / 1e3, (now->events_in - then->events_in) / seconds,
+           (now->bytes_in - then->bytes_in) / seconds / 1e6, (now->events_out - then->events_out) / seconds,
+           (unsigned long) (now->bad_frames - then->bad_frames), (unsigned long) (now->missed_triggers - then->missed_triggers),
+           interval_latency_ms(&now->stages[METRICS_STAGE_READ], &then->stages[METRICS_STAGE_READ]),
+           interval_latency_ms(&now->stages[METRICS_STAGE_DEVICE], &then->stages[METRICS_STAGE_DEVICE]),
+           interval_latency_ms(&now->stages[METRICS_STAGE_WRITE], &then->stages[METRICS_STAGE_WRITE]),
+           interval_latency_ms(&now->stages[METRICS_STAGE_PIPELINE], &then->stages[METRICS_STAGE_PIPELINE]),
+           filled, done, now->job_running ? "" : "  (idle)");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]){
+
+    if (argc < 2 || argc > 3) {
+        printf("Usage: %s <shm_name> [interval_seconds]\n", argv[0]);
+        printf("       Reads the metrics a running app.exe --metrics publishes in shared memory.\n");
+        printf("       Prints them once in Prometheus text format, or with an interval, a line of\n");
+        printf("       rates per interval until interrupted.\n");
+        return -1;
+    }
+    const struct Metrics_Snapshot * shared = metrics_shm_open(argv[1]);
+    if (shared == NULL) {
+        return -1;
+    }
+
+    struct Metrics_Snapshot now, then;
+    if (metrics_read(shared, &now) != 0) {
+        printf("%s holds no metrics snapshot.\n", argv[1]);
+        return -1;
+    }
+    if (argc == 2) {
+        metrics_write_prometheus(&now, stdout);
+        metrics_shm_close(shared);
+        return 0;
+    }
+
+    double interval = atof(argv[2]);
+    useconds_t interval_us = (interval > 0) ? interval * 1e6 : 1000000;
+    for (;;) {
+        then = now;
+        usleep(interval_us);
+        if (metrics_read(shared, &now) != 0) {
+            printf("%s holds no metrics snapshot.\n", argv[1]);
+            return -1;
+        }
+        // Nothing new until the host publishes again
+        if (now.sequence != then.sequence) {
+            print_rates(&now, &then);
+        }
+    }
+}
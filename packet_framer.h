@@ -0,0 +1,350 @@
+#ifndef PACKET_FRAMER_H
+#define PACKET_FRAMER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "preprocess.h"
+
+/*
+ Finds packets in a .dat byte stream. A frame starts with the alpha word,
+ and its omega word sits right after the samples_to_be_read + 1 sample
+ rows, so a frame is only accepted when both are where the header says.
+ Frames normally follow each other directly, or start on PACKET_BYTES
+ slots with padding after a short frame. Anything else (a corrupted or
+ truncated packet, stray bytes) is skipped by scanning for the next alpha
+ at any byte offset and counted as a bad frame.
+
+ The scan checks 16 offsets at a time (SSE2) against the first half of the
+ alpha image, and only compares the full word at offsets that pass.
+*/
+#define FRAME_WORD_BYTES 32 // One 16-bit word, MSB first, each bit an ASCII digit and a space
+#define FRAME_HEADER_WORDS 8
+#define FRAME_MAX_BYTES PACKET_BYTES // Largest frame, and the slot size of padded files
+#define FRAME_STREAM_BYTES (3 * FRAME_MAX_BYTES) // Buffer a Frame_Stream needs
+
+// ASCII images of 0xA1FA and 0x0E6A
+static const uint8_t FRAME_ALPHA_IMAGE[FRAME_WORD_BYTES + 1] = "1 0 1 0 0 0 0 1 1 1 1 1 1 0 1 0 ";
+static const uint8_t FRAME_OMEGA_IMAGE[FRAME_WORD_BYTES + 1] = "0 0 0 0 1 1 1 0 0 1 1 0 1 0 1 0 ";
+
+struct Framer_Stats {
+    uint64_t num_frames;
+    uint64_t num_bad; // Estimated packets lost, at least one per stretch skipped
+    uint64_t skipped_bytes;
+};
+
+// Stream offsets of the frames seen, to tell lost bytes from slot padding
+struct Frame_Span {
+    int64_t first_start; // -1 before the first frame
+    int64_t last_start; // -1 before the first frame
+    int64_t last_end; // 0 before the first frame
+};
+
+static inline void frame_span_init(struct Frame_Span * span) {
+    span->first_start = -1;
+    span->last_start = -1;
+    span->last_end = 0;
+}
+
+// Counts what was skipped between the last frame of span and a frame (or
+// the end of the stream) at next_start
+static inline void framer_count_gap(struct Framer_Stats * stats, const struct Frame_Span * span, int64_t next_start) {
+    if (next_start == span->last_end || (span->last_start >= 0 && next_start == span->last_start + FRAME_MAX_BYTES)) {
+        return;
+    }
+    // Slots from the last frame on, less the two ends, or from the stream start
+    int64_t lost = (span->last_start >= 0) ? (next_start - span->last_start) / FRAME_MAX_BYTES - 1 : next_start / FRAME_MAX_BYTES;
+    stats->num_bad += (lost > 1) ? lost : 1;
+    stats->skipped_bytes += next_start - span->last_end;
+}
+
+static inline uint16_t frame_word(const uint8_t * p) {
+#ifdef __SSE2__
+    // Keep the digit (even) bytes, shift each one's low bit to the top and collect them
+    const __m128i even = _mm_set1_epi16(0x00ff);
+    __m128i lo = _mm_and_si128(_mm_loadu_si128((const __m128i *) p), even);
+    __m128i hi = _mm_and_si128(_mm_loadu_si128((const __m128i *) (p + 16)), even);
+    int bits = _mm_movemask_epi8(_mm_slli_epi16(_mm_packus_epi16(lo, hi), 7)); // Bit k is digit k, the MSB first
+    // Reverse the 16 bits
+    bits = ((bits >> 1) & 0x5555) | ((bits & 0x5555) << 1);
+    bits = ((bits >> 2) & 0x3333) | ((bits & 0x3333) << 2);
+    bits = ((bits >> 4) & 0x0f0f) | ((bits & 0x0f0f) << 4);
+    return (uint16_t) (((bits >> 8) & 0x00ff) | ((bits & 0x00ff) << 8));
+#else
+    uint8_t ms_half = ((p[0] - 0x30) << 7) | ((p[2] - 0x30) << 6) | ((p[4] - 0x30) << 5) | ((p[6] - 0x30) << 4) | ((p[8] - 0x30) << 3) | ((p[10] - 0x30) << 2) | ((p[12] - 0x30) << 1) | (p[14] - 0x30);
+    uint8_t ls_half = ((p[16] - 0x30) << 7) | ((p[18] - 0x30) << 6) | ((p[20] - 0x30) << 5) | ((p[22] - 0x30) << 4) | ((p[24] - 0x30) << 3) | ((p[26] - 0x30) << 2) | ((p[28] - 0x30) << 1) | (p[30] - 0x30);
+    return (ms_half << 8) | ls_half;
+#endif
+}
+
+static inline int frame_word_matches(const uint8_t * p, const uint8_t * image) {
+#ifdef __SSE2__
+    __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), _mm_loadu_si128((const __m128i *) image));
+    __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 16)), _mm_loadu_si128((const __m128i *) (image + 16)));
+    return _mm_movemask_epi8(_mm_and_si128(lo, hi)) == 0xffff;
+#else
+    return memcmp(p, image, FRAME_WORD_BYTES) == 0;
+#endif
+}
+
+static inline long frame_bytes_for(int samples_to_be_read) {
+    return (long) (FRAME_HEADER_WORDS + (samples_to_be_read + 1) * NUM_CHANNELS + 1) * FRAME_WORD_BYTES;
+}
+
+// Returns the length of the frame at p, 0 if there is none, or -1 if it
+// would run past end.
+static inline long frame_check(const uint8_t * p, const uint8_t * end) {
+    if (end - p < FRAME_HEADER_WORDS * FRAME_WORD_BYTES) {
+        return -1;
+    }
+    if (!frame_word_matches(p, FRAME_ALPHA_IMAGE)) {
+        return 0;
+    }
+    long frame_bytes = frame_bytes_for(frame_word(p + 6*FRAME_WORD_BYTES) >> 8);
+    if (end - p < frame_bytes) {
+        return -1;
+    }
+    return frame_word_matches(p + frame_bytes - FRAME_WORD_BYTES, FRAME_OMEGA_IMAGE) ? frame_bytes : 0;
+}
+
+// First offset in [p, end - FRAME_WORD_BYTES] holding the alpha image, or NULL
+static inline const uint8_t * frame_find_alpha(const uint8_t * p, const uint8_t * end) {
+    if (end - p < FRAME_WORD_BYTES) {
+        return NULL;
+    }
+    const uint8_t * last = end - FRAME_WORD_BYTES; // Last offset a whole word fits at
+#ifdef __SSE2__
+    // Probe the first byte-half of the image (8 digits and the space after
+    // the first) at 16 offsets at once, which leaves about one even offset
+    // in 256 to compare in full.
+    const __m128i space = _mm_set1_epi8(' ');
+    for (; p + FRAME_WORD_BYTES / 2 + 16 <= end; p += 16) {
+        __m128i m = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 1)), space);
+        for (int k = 0; k < FRAME_WORD_BYTES / 2; k += 2) {
+            m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + k)), _mm_set1_epi8(FRAME_ALPHA_IMAGE[k])));
+        }
+        unsigned int candidates = _mm_movemask_epi8(m);
+        while (candidates != 0) {
+            const uint8_t * c = p + __builtin_ctz(candidates);
+            if (c <= last && frame_word_matches(c, FRAME_ALPHA_IMAGE)) {
+                return c;
+            }
+            candidates &= candidates - 1;
+        }
+    }
+#endif
+    for (; p <= last; p++) {
+        if (p[0] == FRAME_ALPHA_IMAGE[0] && memcmp(p, FRAME_ALPHA_IMAGE, FRAME_WORD_BYTES) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ Walks the frames of one buffer, which starts at stream offset base.
+ Frames starting in [data, data + own_bytes) are returned; data_bytes may
+ run past that (by up to FRAME_MAX_BYTES) so the last owned frame can be
+ seen whole. Stretches skipped between returned frames are counted. Bytes
+ before the first frame are only counted with counts_leading set, as the
+ caller may know they end a frame of its own (the previous chunk).
+*/
+struct Framer {
+    const uint8_t * data;
+    const uint8_t * pos;
+    const uint8_t * own_end;
+    const uint8_t * data_end;
+    const uint8_t * slot_next; // Next PACKET_BYTES slot, NULL before the first frame
+    int64_t base;
+    int counts_leading;
+    int done;
+    struct Frame_Span span;
+    struct Framer_Stats * stats;
+};
+
+static inline void framer_init(struct Framer * framer, const uint8_t * data, size_t own_bytes, size_t data_bytes,
+                               int64_t base, struct Framer_Stats * stats) {
+    framer->data = data;
+    framer->pos = data;
+    framer->own_end = data + own_bytes;
+    framer->data_end = data + data_bytes;
+    framer->slot_next = NULL;
+    framer->base = base;
+    framer->counts_leading = 0;
+    framer->done = 0;
+    frame_span_init(&framer->span);
+    framer->stats = stats;
+}
+
+// Returns the next owned frame and its length, or NULL when there are no more.
+static inline const uint8_t * framer_next(struct Framer * framer, long * frame_bytes) {
+    if (framer->done || framer->pos >= framer->own_end) {
+        framer->done = 1;
+        return NULL;
+    }
+    const uint8_t * frame = framer->pos;
+    long length = frame_check(frame, framer->data_end);
+    if (length <= 0 && framer->slot_next > framer->pos) {
+        // Padding after a short frame
+        frame = framer->slot_next;
+        length = frame_check(frame, framer->data_end);
+    }
+    if (length <= 0) {
+        // Lost sync, resume at the next alpha that starts a valid frame. Only
+        // owned starts are searched, a sync word must fit before data_end.
+        const uint8_t * search_end = framer->own_end + FRAME_WORD_BYTES - 1;
+        search_end = (search_end < framer->data_end) ? search_end : framer->data_end;
+        frame = NULL;
+        for (const uint8_t * c = framer->pos; (c = frame_find_alpha(c, search_end)) != NULL; c++) {
+            length = frame_check(c, framer->data_end);
+            if (length > 0) {
+                frame = c;
+                break;
+            }
+        }
+    }
+    if (frame == NULL || frame >= framer->own_end) {
+        framer->done = 1;
+        return NULL;
+    }
+
+    int64_t start = framer->base + (frame - framer->data);
+    if (framer->span.first_start >= 0 || framer->counts_leading) {
+        framer_count_gap(framer->stats, &framer->span, start);
+    }
+    if (framer->span.first_start < 0) {
+        framer->span.first_start = start;
+    }
+    framer->span.last_start = start;
+    framer->span.last_end = start + length;
+    framer->stats->num_frames++;
+    framer->pos = frame + length;
+    framer->slot_next = frame + FRAME_MAX_BYTES;
+    *frame_bytes = length;
+    return frame;
+}
+
+// Unpacks the header words of a frame into any packet struct with the
+// DATA_PACKET_FIELDS layout
+#define FRAME_UNPACK_HEADER(buf, data_packet) \
+    do { \
+        (data_packet)->alpha = (buf)[0]; \
+        (data_packet)->i2c_address = 0b111 & ((buf)[1] >> 13); \
+        (data_packet)->conf_address = 0b1111 & ((buf)[1] >> 9); \
+        (data_packet)->bank = 0b1 & ((buf)[1] >> 8); \
+        (data_packet)->fine_time = 0xff & (buf)[1]; \
+        (data_packet)->coarse_time = (((uint32_t) (buf)[2]) << 16) | (((uint32_t) (buf)[3]) & 0xffff); \
+        (data_packet)->trigger_number = (buf)[4]; \
+        (data_packet)->samples_after_trigger = ((buf)[5] >> 8) & 0xff; \
+        (data_packet)->look_back_samples = (buf)[5] & 0xff; \
+        (data_packet)->samples_to_be_read = ((buf)[6] >> 8) & 0xff; \
+        (data_packet)->starting_sample_number = (buf)[6] & 0xff; \
+        (data_packet)->number_of_missed_triggers = ((buf)[7] >> 8) & 0xff; \
+        (data_packet)->state_machine_status = (buf)[7] & 0xff; \
+    } while (0)
+
+static inline void frame_header_words(const uint8_t * frame, uint16_t buf[FRAME_HEADER_WORDS]) {
+    for (int i = 0; i < FRAME_HEADER_WORDS; i++) {
+        buf[i] = frame_word(frame + i*FRAME_WORD_BYTES);
+    }
+}
+
+// Decodes a frame that framer_next returned. The rows past
+// samples_to_be_read are zeroed: the kernel walks all NUM_SAMPLES of them,
+// and a reused packet mustn't carry in what the last frame decoded into it.
+static inline void frame_decode(const uint8_t * frame, struct SW_Data_Packet * data_packet) {
+    uint16_t buf[FRAME_HEADER_WORDS];
+    frame_header_words(frame, buf);
+    FRAME_UNPACK_HEADER(buf, data_packet);
+
+    const uint8_t * p = frame + FRAME_HEADER_WORDS*FRAME_WORD_BYTES;
+    for (int i = 0; i < data_packet->samples_to_be_read + 1; i++) {
+        for (int j = 0; j < NUM_CHANNELS; j++) {
+            data_packet->samples[i][j] = frame_word(p) & 0xfff;
+            p += FRAME_WORD_BYTES;
+        }
+    }
+    int num_read = data_packet->samples_to_be_read + 1;
+    memset(data_packet->samples + num_read, 0, (NUM_SAMPLES - num_read) * sizeof(data_packet->samples[0]));
+    data_packet->omega = frame_word(p);
+}
+
+/*
+ Framer over a file descriptor, for the programs that read one packet at
+ a time. buf must hold FRAME_STREAM_BYTES.
+*/
+struct Frame_Stream {
+    int fd;
+    uint8_t * buf;
+    int64_t base; // Stream offset of buf[0]
+    size_t start; // Next byte to frame
+    size_t fill;
+    int eof;
+    struct Frame_Span span;
+    struct Framer_Stats stats;
+};
+
+static inline void frame_stream_init(struct Frame_Stream * stream, int fd, uint8_t * buf) {
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = fd;
+    stream->buf = buf;
+    frame_span_init(&stream->span);
+}
+
+// Returns the next frame, valid until the next call, or NULL at the end of the stream.
+static inline const uint8_t * frame_stream_next(struct Frame_Stream * stream, long * frame_bytes) {
+    for (;;) {
+        // Keep two frames' worth buffered past start, so a frame starting in the first always fits
+        if (!stream->eof && stream->fill - stream->start < 2 * FRAME_MAX_BYTES) {
+            memmove(stream->buf, stream->buf + stream->start, stream->fill - stream->start);
+            stream->base += stream->start;
+            stream->fill -= stream->start;
+            stream->start = 0;
+            while (!stream->eof && stream->fill < FRAME_STREAM_BYTES) {
+                ssize_t n = read(stream->fd, stream->buf + stream->fill, FRAME_STREAM_BYTES - stream->fill);
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (n == -1) {
+                    perror("read");
+                }
+                if (n <= 0) {
+                    stream->eof = 1;
+                }
+                else {
+                    stream->fill += n;
+                }
+            }
+        }
+        size_t avail = stream->fill - stream->start;
+        size_t own = stream->eof ? avail : avail - FRAME_MAX_BYTES;
+        struct Framer framer;
+        framer_init(&framer, stream->buf + stream->start, own, avail, stream->base + stream->start, &stream->stats);
+        framer.counts_leading = 1;
+        framer.span = stream->span;
+        if (stream->span.last_start >= 0 && stream->span.last_start + FRAME_MAX_BYTES > stream->base + (int64_t) stream->start) {
+            framer.slot_next = stream->buf + (stream->span.last_start - stream->base) + FRAME_MAX_BYTES;
+        }
+        const uint8_t * frame = framer_next(&framer, frame_bytes);
+        stream->span = framer.span;
+        if (frame != NULL) {
+            stream->start = framer.pos - stream->buf;
+            return frame;
+        }
+        // Nothing starts in the owned bytes
+        stream->start += own;
+        if (stream->eof) {
+            framer_count_gap(&stream->stats, &stream->span, stream->base + stream->fill);
+            stream->span.last_end = stream->base + stream->fill;
+            return NULL;
+        }
+    }
+}
+
+#endif // PACKET_FRAMER_H
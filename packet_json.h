@@ -0,0 +1,249 @@
+#ifndef PACKET_JSON_H
+#define PACKET_JSON_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "preprocess.h"
+
+/*
+ Streaming packet dump for event displays, one JSON object per line
+ (NDJSON). Each line holds the header fields and the samples read, and
+ optionally the pedestal generation, the pedestal-subtracted samples and
+ the integrals and pulse features of the sparse record:
+
+   {"alpha":41466,"i2c_address":7,...,"samples":[...],"omega":3690,
+    "ped_generation":0,"ped_sub":[...],"channel_mask":65535,
+    "integrals":[[...],...],"peak":[...],"peak_time":[...],"cfd_time":[...]}
+
+ samples and ped_sub are the (samples_to_be_read + 1) * NUM_CHANNELS
+ values read, sample by sample, channels innermost, like the run file.
+ integrals has one array per window and the features one value per kept
+ channel, in channel order. cfd_time is in 1/2^CFD_TIME_SHIFT samples,
+ null where there was no crossing.
+
+ Lines are formatted with a two-digits-at-a-time integer formatter into a
+ JSON_BUFFER_BYTES buffer, which is written out in one call when the
+ next packet might not fit, so a dump costs a few large writes. A
+ trigger-number range and a prescale (every n-th packet in the range)
+ keep the rate down when it's left on.
+*/
+#define JSON_BUFFER_BYTES (1 << 20)
+// Worst case: a 6-byte value for every sample and pedestal-subtracted
+// sample, 12 bytes for every record word, and the header
+#define JSON_MAX_PACKET_BYTES (2*6*NUM_SAMPLES*NUM_CHANNELS + 12*SPARSE_RECORD_MAX_WORDS + 1024)
+
+// What goes with the header and samples. NULL, or a negative ped_generation, leaves it out.
+struct Json_Extras {
+    int64_t ped_generation;
+    const int16_t * ped_sub;
+    int sample_stride; // Elements between consecutive samples of ped_sub
+    int channel_stride; // Elements between consecutive channels
+    const int32_t * record; // Channel mask, then CHANNEL_WORDS per kept channel
+};
+
+struct Json_Exporter {
+    int fd;
+    uint32_t prescale; // Export every prescale-th packet in the trigger range
+    uint32_t prescale_count;
+    uint16_t first_trigger; // Trigger-number range, inclusive
+    uint16_t last_trigger;
+    char * buf;
+    size_t fill;
+    uint64_t num_seen;
+    uint64_t num_exported;
+    uint64_t bytes_written;
+};
+
+static const char json_digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static inline char * json_put_uint(char * p, uint32_t v) {
+    char digits[10];
+    char * d = digits + sizeof(digits);
+    while (v >= 100) {
+        uint32_t pair = v % 100;
+        v /= 100;
+        d -= 2;
+        memcpy(d, json_digit_pairs + 2*pair, 2);
+    }
+    if (v >= 10) {
+        d -= 2;
+        memcpy(d, json_digit_pairs + 2*v, 2);
+    }
+    else {
+        *--d = '0' + v;
+    }
+    size_t n = digits + sizeof(digits) - d;
+    memcpy(p, d, n);
+    return p + n;
+}
+
+static inline char * json_put_int(char * p, int32_t v) {
+    if (v < 0) {
+        *p++ = '-';
+        return json_put_uint(p, 0u - (uint32_t) v);
+    }
+    return json_put_uint(p, v);
+}
+
+static inline char * json_put_text(char * p, const char * text) {
+    size_t n = strlen(text);
+    memcpy(p, text, n);
+    return p + n;
+}
+
+// ,"name":value, or without the comma for the first field
+static inline char * json_put_field(char * p, const char * name, uint32_t value) {
+    p = json_put_text(p, name);
+    return json_put_uint(p, value);
+}
+
+static inline int json_exporter_open(struct Json_Exporter * exporter, int fd, uint32_t prescale,
+                                     uint16_t first_trigger, uint16_t last_trigger) {
+    memset(exporter, 0, sizeof(*exporter));
+    exporter->fd = fd;
+    exporter->prescale = (prescale > 0) ? prescale : 1;
+    exporter->first_trigger = first_trigger;
+    exporter->last_trigger = last_trigger;
+    exporter->buf = (char *) malloc(JSON_BUFFER_BYTES);
+    if (exporter->buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+// Counts the packet and says whether to export it. Callers can skip
+// preparing the extras of packets that aren't.
+static inline int json_exporter_wants(struct Json_Exporter * exporter, uint16_t trigger_number) {
+    exporter->num_seen++;
+    if (trigger_number < exporter->first_trigger || trigger_number > exporter->last_trigger) {
+        return 0;
+    }
+    if (++exporter->prescale_count < exporter->prescale) {
+        return 0;
+    }
+    exporter->prescale_count = 0;
+    return 1;
+}
+
+static inline int json_exporter_flush(struct Json_Exporter * exporter) {
+    const char * p = exporter->buf;
+    size_t count = exporter->fill;
+    while (count > 0) {
+        ssize_t n = write(exporter->fd, p, count);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror("write");
+            exporter->fill = 0;
+            return -1;
+        }
+        p += n;
+        count -= n;
+    }
+    exporter->bytes_written += exporter->fill;
+    exporter->fill = 0;
+    return 0;
+}
+
+static inline char * json_put_record(char * p, const int32_t * record) {
+    static const char * const feature_fields[NUM_FEATURES] = {"],\"peak\":[", "],\"peak_time\":[", "],\"cfd_time\":["};
+    uint32_t mask = record[0];
+    int num_kept = __builtin_popcount(mask);
+    p = json_put_field(p, ",\"channel_mask\":", mask);
+    p = json_put_text(p, ",\"integrals\":[");
+    for (int i = 0; i < CHANNEL_WORDS; i++) {
+        if (i < NUM_WINDOWS) {
+            p = json_put_text(p, (i == 0) ? "[" : "],[");
+        }
+        else {
+            p = json_put_text(p, feature_fields[i - NUM_WINDOWS]);
+        }
+        for (int k = 0; k < num_kept; k++) {
+            int32_t value = record[1 + k*CHANNEL_WORDS + i];
+            if (k > 0) {
+                *p++ = ',';
+            }
+            p = (i == CHANNEL_WORDS-1 && value == CFD_NO_CROSSING) ? json_put_text(p, "null") : json_put_int(p, value);
+        }
+        if (i == NUM_WINDOWS-1) {
+            *p++ = ']';
+        }
+    }
+    *p++ = ']';
+    return p;
+}
+
+static inline int json_export_packet(struct Json_Exporter * exporter, const struct SW_Data_Packet * data_packet,
+                                     const struct Json_Extras * extras) {
+    if (exporter->fill + JSON_MAX_PACKET_BYTES > JSON_BUFFER_BYTES && json_exporter_flush(exporter) != 0) {
+        return -1;
+    }
+    char * p = exporter->buf + exporter->fill;
+    p = json_put_field(p, "{\"alpha\":", data_packet->alpha);
+    p = json_put_field(p, ",\"i2c_address\":", data_packet->i2c_address);
+    p = json_put_field(p, ",\"conf_address\":", data_packet->conf_address);
+    p = json_put_field(p, ",\"bank\":", data_packet->bank);
+    p = json_put_field(p, ",\"fine_time\":", data_packet->fine_time);
+    p = json_put_field(p, ",\"coarse_time\":", data_packet->coarse_time);
+    p = json_put_field(p, ",\"trigger_number\":", data_packet->trigger_number);
+    p = json_put_field(p, ",\"samples_after_trigger\":", data_packet->samples_after_trigger);
+    p = json_put_field(p, ",\"look_back_samples\":", data_packet->look_back_samples);
+    p = json_put_field(p, ",\"samples_to_be_read\":", data_packet->samples_to_be_read);
+    p = json_put_field(p, ",\"starting_sample_number\":", data_packet->starting_sample_number);
+    p = json_put_field(p, ",\"number_of_missed_triggers\":", data_packet->number_of_missed_triggers);
+    p = json_put_field(p, ",\"state_machine_status\":", data_packet->state_machine_status);
+
+    int num_read = data_packet->samples_to_be_read + 1;
+    p = json_put_text(p, ",\"samples\":[");
+    for (int i = 0; i < num_read; i++) {
+        for (int j = 0; j < NUM_CHANNELS; j++) {
+            p = json_put_uint(p, data_packet->samples[i][j]);
+            *p++ = ',';
+        }
+    }
+    p[-1] = ']';
+    p = json_put_field(p, ",\"omega\":", data_packet->omega);
+
+    if (extras != NULL && extras->ped_generation >= 0) {
+        p = json_put_field(p, ",\"ped_generation\":", (uint32_t) extras->ped_generation);
+    }
+    if (extras != NULL && extras->ped_sub != NULL) {
+        p = json_put_text(p, ",\"ped_sub\":[");
+        for (int i = 0; i < num_read; i++) {
+            const int16_t * row = extras->ped_sub + i*extras->sample_stride;
+            for (int j = 0; j < NUM_CHANNELS; j++) {
+                p = json_put_int(p, row[j*extras->channel_stride]);
+                *p++ = ',';
+            }
+        }
+        p[-1] = ']';
+    }
+    if (extras != NULL && extras->record != NULL) {
+        p = json_put_record(p, extras->record);
+    }
+    *p++ = '}';
+    *p++ = '\n';
+    exporter->fill = p - exporter->buf;
+    exporter->num_exported++;
+    return 0;
+}
+
+// Writes out what's buffered and frees the buffer. The caller closes fd.
+static inline int json_exporter_close(struct Json_Exporter * exporter) {
+    int status = json_exporter_flush(exporter);
+    free(exporter->buf);
+    exporter->buf = NULL;
+    return status;
+}
+
+#endif // PACKET_JSON_H
@@ -0,0 +1,220 @@
+#ifndef PIPELINE_METRICS_H
+#define PIPELINE_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/*
+ Live metrics of the host pipeline (app.exe --metrics). Every pipeline
+ thread counts into its own cache line, and a publisher thread sums them
+ every METRICS_INTERVAL_MILLISECONDS into a Metrics_Snapshot, which it
+ writes out as a Prometheus text file and copies into a POSIX
+ shared-memory object for local monitors (see metrics-monitor.c).
+
+ The shared copy is a seqlock: the publisher makes sequence odd, copies
+ the snapshot in and makes it even again. A reader copies the snapshot
+ out and retries if sequence was odd or changed meanwhile, so neither
+ side ever waits on the other and the pipeline never sees the readers.
+
+ Counters are totals since the host started, across jobs, gauges are
+ the values at publish time.
+*/
+#define METRICS_MAGIC 0x5352544d // "MTRS"
+#define METRICS_VERSION 1
+#define METRICS_MAX_LANES 32
+#define METRICS_MAX_CARDS 16
+#define METRICS_STATUS_CODES 256 // state_machine_status is 8 bits
+
+// Where latency is measured, per batch
+enum Metrics_Stage {
+    METRICS_STAGE_READ, // Reader: framing and decoding a batch
+    METRICS_STAGE_DEVICE, // Dispatcher: input migration to the end of the readback
+    METRICS_STAGE_WRITE, // Writer: text output, archive and snapshots
+    METRICS_STAGE_PIPELINE, // From the reader taking a free slot to the writer freeing it
+    METRICS_NUM_STAGES
+};
+
+static const char * const metrics_stage_names[METRICS_NUM_STAGES] = {"read", "device", "write", "pipeline"};
+
+struct Metrics_Latency {
+    uint64_t count; // Batches
+    uint64_t total_ns;
+    uint64_t max_ns; // Largest since the last publish
+};
+
+struct Metrics_Snapshot {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sequence; // Odd while the publisher is copying
+    uint64_t published_unix_ms;
+    uint64_t uptime_ms;
+    uint32_t num_lanes;
+    uint32_t num_cards;
+    uint64_t jobs_started;
+    uint64_t jobs_finished;
+    uint32_t job_running;
+    uint32_t reserved;
+
+    // Counters
+    uint64_t events_in; // Packets framed from run files
+    uint64_t events_out; // Records written to outputs
+    uint64_t bytes_in; // Run file bytes framed
+    uint64_t bytes_out; // Text output bytes
+    uint64_t bad_frames;
+    uint64_t skipped_bytes; // Skipped resynchronizing
+    uint64_t missed_triggers; // Sum of each ASIC's number_of_missed_triggers increments
+    uint64_t status_counts[METRICS_STATUS_CODES]; // Packets by state_machine_status
+    struct Metrics_Latency stages[METRICS_NUM_STAGES];
+    uint64_t card_events[METRICS_MAX_CARDS];
+    uint64_t card_busy_ns[METRICS_MAX_CARDS];
+
+    // Gauges, batches queued per lane
+    uint32_t free_depth[METRICS_MAX_LANES];
+    uint32_t filled_depth[METRICS_MAX_LANES];
+    uint32_t done_depth[METRICS_MAX_LANES];
+};
+
+// Creates (or takes over) the shared-memory object and maps it. Returns NULL on failure.
+static inline struct Metrics_Snapshot * metrics_shm_create(const char * name) {
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd == -1) {
+        perror("shm_open");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(struct Metrics_Snapshot)) != 0) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+    void * shared = mmap(NULL, sizeof(struct Metrics_Snapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return (struct Metrics_Snapshot *) shared;
+}
+
+// Maps an existing object read-only. Returns NULL on failure.
+static inline const struct Metrics_Snapshot * metrics_shm_open(const char * name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        perror("shm_open");
+        return NULL;
+    }
+    void * shared = mmap(NULL, sizeof(struct Metrics_Snapshot), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return (const struct Metrics_Snapshot *) shared;
+}
+
+static inline void metrics_shm_close(const struct Metrics_Snapshot * shared) {
+    munmap((void *) shared, sizeof(struct Metrics_Snapshot));
+}
+
+// Writer side of the seqlock, one publisher only
+static inline void metrics_publish(struct Metrics_Snapshot * shared, const struct Metrics_Snapshot * snapshot) {
+    uint64_t sequence = __atomic_load_n(&shared->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // The odd sequence is visible before any of the copy
+    const size_t head = offsetof(struct Metrics_Snapshot, sequence) + sizeof(shared->sequence);
+    memcpy(shared, snapshot, offsetof(struct Metrics_Snapshot, sequence));
+    memcpy((uint8_t *) shared + head, (const uint8_t *) snapshot + head, sizeof(*snapshot) - head);
+    __atomic_store_n(&shared->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+// Reader side. Returns 0 with a consistent copy, -1 if the object isn't a snapshot.
+static inline int metrics_read(const struct Metrics_Snapshot * shared, struct Metrics_Snapshot * snapshot) {
+    for (;;) {
+        uint64_t before = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            usleep(100);
+            continue;
+        }
+        memcpy(snapshot, shared, sizeof(*snapshot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); // The copy is done before sequence is checked again
+        if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == before) {
+            snapshot->sequence = before;
+            break;
+        }
+    }
+    if (snapshot->magic != METRICS_MAGIC || snapshot->version != METRICS_VERSION) {
+        return -1;
+    }
+    return 0;
+}
+
+static inline void metrics_write_metric(FILE * fp, const char * name, const char * type, const char * help) {
+    fprintf(fp, "# HELP preprocess_%s %s\n# TYPE preprocess_%s %s\n", name, help, name, type);
+}
+
+// Prometheus text exposition format
+static inline int metrics_write_prometheus(const struct Metrics_Snapshot * s, FILE * fp) {
+    metrics_write_metric(fp, "uptime_seconds", "gauge", "Time since the host started.");
+    fprintf(fp, "preprocess_uptime_seconds %.3f\n", s->uptime_ms / 1e3);
+    metrics_write_metric(fp, "jobs_started_total", "counter", "Jobs started.");
+    fprintf(fp, "preprocess_jobs_started_total %lu\n", (unsigned long) s->jobs_started);
+    metrics_write_metric(fp, "jobs_finished_total", "counter", "Jobs finished.");
+    fprintf(fp, "preprocess_jobs_finished_total %lu\n", (unsigned long) s->jobs_finished);
+    metrics_write_metric(fp, "job_running", "gauge", "1 while a job is in the pipeline.");
+    fprintf(fp, "preprocess_job_running %u\n", s->job_running);
+
+    metrics_write_metric(fp, "events_in_total", "counter", "Packets framed from run files.");
+    fprintf(fp, "preprocess_events_in_total %lu\n", (unsigned long) s->events_in);
+    metrics_write_metric(fp, "events_out_total", "counter", "Records written to outputs.");
+    fprintf(fp, "preprocess_events_out_total %lu\n", (unsigned long) s->events_out);
+    metrics_write_metric(fp, "bytes_in_total", "counter", "Run file bytes framed.");
+    fprintf(fp, "preprocess_bytes_in_total %lu\n", (unsigned long) s->bytes_in);
+    metrics_write_metric(fp, "bytes_out_total", "counter", "Text output bytes written.");
+    fprintf(fp, "preprocess_bytes_out_total %lu\n", (unsigned long) s->bytes_out);
+    metrics_write_metric(fp, "bad_frames_total", "counter", "Packet slots lost to corrupt or missing frames.");
+    fprintf(fp, "preprocess_bad_frames_total %lu\n", (unsigned long) s->bad_frames);
+    metrics_write_metric(fp, "skipped_bytes_total", "counter", "Run file bytes skipped resynchronizing.");
+    fprintf(fp, "preprocess_skipped_bytes_total %lu\n", (unsigned long) s->skipped_bytes);
+    metrics_write_metric(fp, "missed_triggers_total", "counter", "Triggers the ASICs reported missing.");
+    fprintf(fp, "preprocess_missed_triggers_total %lu\n", (unsigned long) s->missed_triggers);
+
+    metrics_write_metric(fp, "status_total", "counter", "Packets by state_machine_status.");
+    for (int code = 0; code < METRICS_STATUS_CODES; code++) {
+        if (s->status_counts[code] != 0) {
+            fprintf(fp, "preprocess_status_total{status=\"%d\"} %lu\n", code, (unsigned long) s->status_counts[code]);
+        }
+    }
+
+    metrics_write_metric(fp, "stage_seconds", "summary", "Time spent per batch, by pipeline stage.");
+    for (int stage = 0; stage < METRICS_NUM_STAGES; stage++) {
+        fprintf(fp, "preprocess_stage_seconds_sum{stage=\"%s\"} %.9f\n", metrics_stage_names[stage], s->stages[stage].total_ns / 1e9);
+        fprintf(fp, "preprocess_stage_seconds_count{stage=\"%s\"} %lu\n", metrics_stage_names[stage], (unsigned long) s->stages[stage].count);
+    }
+    metrics_write_metric(fp, "stage_max_seconds", "gauge", "Slowest batch since the last publish, by pipeline stage.");
+    for (int stage = 0; stage < METRICS_NUM_STAGES; stage++) {
+        fprintf(fp, "preprocess_stage_max_seconds{stage=\"%s\"} %.9f\n", metrics_stage_names[stage], s->stages[stage].max_ns / 1e9);
+    }
+
+    metrics_write_metric(fp, "card_events_total", "counter", "Events run on each card.");
+    for (uint32_t d = 0; d < s->num_cards; d++) {
+        fprintf(fp, "preprocess_card_events_total{card=\"%u\"} %lu\n", d, (unsigned long) s->card_events[d]);
+    }
+    metrics_write_metric(fp, "card_busy_seconds_total", "counter", "Time each card spent on batches.");
+    for (uint32_t d = 0; d < s->num_cards; d++) {
+        fprintf(fp, "preprocess_card_busy_seconds_total{card=\"%u\"} %.9f\n", d, s->card_busy_ns[d] / 1e9);
+    }
+
+    metrics_write_metric(fp, "queue_depth", "gauge", "Batches queued in each lane's rings.");
+    for (uint32_t l = 0; l < s->num_lanes; l++) {
+        fprintf(fp, "preprocess_queue_depth{ring=\"free\",lane=\"%u\"} %u\n", l, s->free_depth[l]);
+        fprintf(fp, "preprocess_queue_depth{ring=\"filled\",lane=\"%u\"} %u\n", l, s->filled_depth[l]);
+        fprintf(fp, "preprocess_queue_depth{ring=\"done\",lane=\"%u\"} %u\n", l, s->done_depth[l]);
+    }
+    return ferror(fp) ? -1 : 0;
+}
+
+#endif // PIPELINE_METRICS_H
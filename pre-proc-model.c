@@ -4,159 +4,102 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
+#include <time.h>
 
-// char: 8 bit, short: 16 bit, long: 32 bit
-
-#define NUM_CHANNELS 16
-#define NUM_SAMPLES 256 // N
-#define BUF_SIZE 4105 // 8 + N*16 + 1 words (16 bits / 2 bytes per word)
-
-/*
- Mimics incoming data packet in C types.
-*/
-struct SW_Data_Packet {
-    uint16_t alpha; // Start Constant 0xA1FA
-    uint8_t i2c_address; // 3 bits
-    uint8_t conf_address; // 4 bits
-    uint8_t bank; // 1 bit, A or B
-    uint8_t fine_time; // 8 bits, sample number when trigger arrives
-    uint32_t coarse_time; // 32 bits
-    uint16_t trigger_number; // 16 bits
-    uint8_t samples_after_trigger; // 8 bits
-    uint8_t look_back_samples; // 8 bits
-    uint8_t samples_to_be_read; // 8 bits
-    uint8_t starting_sample_number; // 8 bits
-    uint8_t number_of_missed_triggers; // 8 bits
-    uint8_t state_machine_status; // 8 bits
-    uint16_t samples[NUM_SAMPLES][NUM_CHANNELS]; // Variable size?
-    // Looks like N samples for 16 channels (so 1 ASIC)
-    uint16_t omega; // End Constant 0x0E6A
-};
+#include "preprocess.h"
+#include "pre_proc_model.h"
+#include "buffer_pool.h"
+#include "packet_framer.h"
+#include "channel_major.h"
+#include "packet_json.h"
 
 struct SW_Data_Packet data_packet;
+struct Buffer_Pool arena; // Page-aligned scratch buffers, one run file's Frame_Stream window per slot
 
 //uint16_t peds_a[NUM_SAMPLES][NUM_CHANNELS]; // Really 12 bits
 //uint16_t peds_b[NUM_SAMPLES][NUM_CHANNELS]; // Really 12 bits
 uint16_t all_peds[2][NUM_SAMPLES][NUM_CHANNELS]; // Really 12 bits
 
 int16_t ped_sub_results[NUM_SAMPLES][NUM_CHANNELS]; // Really 13 bits
-int32_t integrals[4][NUM_CHANNELS]; // Really 21 bits
-
-
-void add_to_json(int json_fd, char * field, uint32_t value, uint8_t is_first, uint8_t is_last){
-    char value_ptr[10];
-    if (is_first) {
-        write(json_fd, "{ \"", 3);
-    }
-    write(json_fd, field, strlen(field));
-    write(json_fd, "\": ", 3);
-    sprintf(value_ptr, "%d", value);
-    write(json_fd, value_ptr, strlen(value_ptr));
-    if (!is_last) {
-        write(json_fd, ", \"", 3);
-    }
-    else {
-        write(json_fd, " }", 2);
-    }
-}
+int32_t integrals[NUM_WINDOWS][NUM_CHANNELS]; // Really 21 bits
+int32_t features[NUM_FEATURES][NUM_CHANNELS]; // Peak, peak time, CFD time over the widest window
 
-void add_samples_to_json(int json_fd){
-    char value_ptr[10];
-    write(json_fd, "samples", 7);
-    write(json_fd, "\": [ ", 5);
-
-    for (int i = 0; i < NUM_SAMPLES; i++) {
-        for (int j = 0; j < NUM_CHANNELS; j++) {
-            sprintf(value_ptr, "%d", data_packet.samples[i][j]);
-            write(json_fd, value_ptr, strlen(value_ptr));
-            write(json_fd, ", ", 2);
-        }
-    }
-    lseek(json_fd, -2, SEEK_CUR);
-    write(json_fd, " ], \"", 5);
-}
+int32_t thresholds[NUM_CHANNELS]; // Zero-suppression threshold per channel
+int32_t sparse_record[SPARSE_RECORD_MAX_WORDS];
 
-int struct_to_json(int json_fd){
-    add_to_json(json_fd, "alpha", data_packet.alpha, 1, 0);
-    add_to_json(json_fd, "i2c_address", data_packet.i2c_address, 0, 0);
-    add_to_json(json_fd, "conf_address", data_packet.conf_address, 0, 0);
-    add_to_json(json_fd, "bank", data_packet.bank, 0, 0);
-    add_to_json(json_fd, "fine_time", data_packet.fine_time, 0, 0);
-    add_to_json(json_fd, "coarse_time", data_packet.coarse_time, 0, 0);
-    add_to_json(json_fd, "trigger_number", data_packet.trigger_number, 0, 0);
-    add_to_json(json_fd, "samples_after_trigger", data_packet.samples_after_trigger, 0, 0);
-    add_to_json(json_fd, "look_back_samples", data_packet.look_back_samples, 0, 0);
-    add_to_json(json_fd, "samples_to_be_read", data_packet.samples_to_be_read, 0, 0);
-    add_to_json(json_fd, "starting_sample_number", data_packet.starting_sample_number, 0, 0);
-    add_to_json(json_fd, "number_of_missed_triggers", data_packet.number_of_missed_triggers, 0, 0);
-    add_to_json(json_fd, "state_machine_status", data_packet.state_machine_status, 0, 0);
-    add_samples_to_json(json_fd);
-    add_to_json(json_fd, "omega", data_packet.omega, 0, 1);
-    return 0;
-}
+// Channel-major copies, see channel_major.h
+int channel_major = 0; // --channel-major: subtract and integrate from cm_packet
+struct Channel_Major_Packet cm_packet;
+uint16_t cm_peds[2][NUM_CHANNELS][NUM_SAMPLES];
+int16_t cm_ped_sub_results[NUM_CHANNELS][NUM_SAMPLES];
 
-int data_packet_dat_to_struct(int fd){
+#define PEDS_BIN_MAGIC 0x53444550 // "PEDS"
 
-    // Read data into a larger buffer and then strip 
-    // all of the spaces because dat files are bit-space-delineated.
+/*
+ Header of the binary pedestal table, followed by
+ uint16_t peds[2][NUM_SAMPLES][NUM_CHANNELS] (same layout as all_peds) and
+ float rms[2][NUM_SAMPLES][NUM_CHANNELS].
+*/
+struct Peds_Bin_Header {
+    uint32_t magic;
+    uint16_t num_banks;
+    uint16_t num_samples;
+    uint16_t num_channels;
+    uint16_t reserved;
+    uint32_t num_events;
+};
 
-    // The times two is to account for the space-delineation
-    int num_bits = BUF_SIZE * 16 * 2;
-    uint8_t og_buf[num_bits];
+/*
+ Running sums for a pedestal run, one entry per (bank, storage cell, channel).
+ Each cell accumulates relative to the first value it saw so the variance
+ doesn't suffer from cancellation, and the sums stay exact integers.
+ Channels are innermost so every update is a 16-wide vector operation.
+*/
+struct Ped_Calibration {
+    uint32_t num_events;
+    uint32_t num_rejected;
+    uint32_t counts[2][NUM_SAMPLES];
+    int32_t offsets[2][NUM_SAMPLES][NUM_CHANNELS];
+    int64_t sums[2][NUM_SAMPLES][NUM_CHANNELS];
+    int64_t sums_sq[2][NUM_SAMPLES][NUM_CHANNELS];
+};
 
-    if (read(fd, og_buf, num_bits) == -1) {
-        perror("read");
-    }
+struct Ped_Calibration ped_calibration;
+uint16_t calibrated_peds[2][NUM_SAMPLES][NUM_CHANNELS];
+float calibrated_rms[2][NUM_SAMPLES][NUM_CHANNELS];
 
-    for (int i = 0; i < num_bits; i++) {
-        og_buf[i] = og_buf[i] - 0x30; // 0 in ASCII
-    }
 
-    uint16_t buf[BUF_SIZE];
-    uint8_t ms_half, ls_half;
-    int base = 0;
-    for (int i = 0; i < BUF_SIZE; i++) {
-        base = i * 32;
-        ms_half = (og_buf[base] << 7) | (og_buf[base + 2] << 6) | (og_buf[base + 4] << 5) | (og_buf[base + 6] << 4) | (og_buf[base + 8] << 3) | (og_buf[base + 10] << 2) | (og_buf[base + 12] << 1) | og_buf[base + 14];
-        ls_half = (og_buf[base + 16] << 7) | (og_buf[base + 18] << 6) | (og_buf[base + 20] << 5) | (og_buf[base + 22] << 4) | (og_buf[base + 24] << 3) | (og_buf[base + 26] << 2) | (og_buf[base + 28] << 1) | og_buf[base + 30];
-        buf[i] = (ms_half << 8) | ls_half;
+// Exports the packet in data_packet with its pedestal-subtracted samples and sparse record
+int export_packet(struct Json_Exporter * exporter) {
+    struct Json_Extras extras;
+    extras.ped_generation = -1;
+    if (channel_major) {
+        extras.ped_sub = &cm_ped_sub_results[0][0];
+        extras.sample_stride = 1;
+        extras.channel_stride = NUM_SAMPLES;
     }
-
-    // First short should be 0xA1FA
-    if (buf[0] != 0xa1fa) {
-        printf("File must start with word 0xA1FA.\n");
-        return -2;
+    else {
+        extras.ped_sub = &ped_sub_results[0][0];
+        extras.sample_stride = NUM_CHANNELS;
+        extras.channel_stride = 1;
     }
+    extras.record = sparse_record;
+    return json_export_packet(exporter, &data_packet, &extras);
+}
 
-    data_packet.alpha = buf[0];
-    data_packet.i2c_address = 0b111 & (buf[1] >> 13);
-    data_packet.conf_address = 0b1111 & (buf[1] >> 9);
-    data_packet.bank = 0b1 & (buf[1] >> 8);
-    data_packet.fine_time = 0xff & buf[1];
-    data_packet.coarse_time = (((uint32_t) buf[2]) << 16) & (((uint32_t) buf[3]) & 0xffff);
-    data_packet.trigger_number = buf[4];
-    data_packet.samples_after_trigger = (buf[5] >> 8) & 0xff;
-    data_packet.look_back_samples = buf[5] & 0xff;
-    data_packet.samples_to_be_read = (buf[6] >> 8) & 0xff;
-    data_packet.starting_sample_number = buf[6] & 0xff;
-    data_packet.number_of_missed_triggers = (buf[7] >> 8) & 0xff;
-    data_packet.state_machine_status = buf[7] & 0xff;
-
-    int buf_idx = 8;
-    for (int i = 0; i < data_packet.samples_to_be_read + 1; i++) {
-        for (int j = 0; j < NUM_CHANNELS; j++) {
-            data_packet.samples[i][j] = buf[buf_idx] & 0xfff;
-            buf_idx++;
-        }
+// Decodes the next packet of the run into data_packet, and cm_packet with
+// --channel-major. Returns -1 at the end of the run.
+int data_packet_dat_to_struct(struct Frame_Stream * stream){
+    long frame_bytes;
+    const uint8_t * frame = frame_stream_next(stream, &frame_bytes);
+    if (frame == NULL) {
+        return -1;
     }
-
-    // Last short should be 0x0E6A
-    if (buf[buf_idx] != 0x0e6a) {
-        printf("File must end with word 0x0E6A.\n");
-        return -3;
+    frame_decode(frame, &data_packet);
+    if (channel_major) {
+        frame_decode_channel_major(frame, &cm_packet);
     }
-    data_packet.omega = buf[buf_idx];
-
     return 0;
 }
 
@@ -193,9 +136,12 @@ int peds_dat_to_arrays(int fd){
     return 0;
 }
 
+// Every row, like the kernel. Past samples_to_be_read the samples are the
+// zeros frame_decode leaves, so a window reaching there doesn't see the
+// last packet's values.
 int ped_subtract() {
     int ped_sample_idx = data_packet.starting_sample_number;
-    for (int i = 0; i < data_packet.samples_to_be_read + 1; i++) {
+    for (int i = 0; i < NUM_SAMPLES; i++) {
         for (int j = 0; j < NUM_CHANNELS; j++) {
             ped_sub_results[i][j] = data_packet.samples[i][j] - all_peds[data_packet.bank][ped_sample_idx][j];
         }
@@ -217,30 +163,262 @@ int integral(int rel_start, int rel_end, int integral_num) {
         end = end - data_packet.samples_to_be_read;
     }
     int32_t integral;
+    // Pulse features are taken over the last (widest) window
+    int find_features = (integral_num == NUM_WINDOWS-1);
+    struct Pulse_Tracker tracker;
+    int position;
     if (end >= start) {
         for (int i = 0; i < NUM_CHANNELS; i++) {
             integral = 0;
+            reset_pulse(&tracker);
+            position = 0;
             for (int j = start; j <= end; j++) {
                 integral = integral + ped_sub_results[j][i];
+                if (find_features) {
+                    track_pulse(&tracker, position++, ped_sub_results[j][i]);
+                }
             }
             integrals[integral_num][i] = integral;
+            if (find_features) {
+                features[0][i] = tracker.peak;
+                features[1][i] = rel_start + tracker.peak_position;
+                features[2][i] = pulse_cfd_time(&tracker, rel_start);
+            }
         }
     }
     else {
         for (int i = 0; i < NUM_CHANNELS; i++) {
             integral = 0;
+            reset_pulse(&tracker);
+            position = 0;
             for (int j = start; j < NUM_SAMPLES; j++) {
                 integral = integral + ped_sub_results[j][i];
+                if (find_features) {
+                    track_pulse(&tracker, position++, ped_sub_results[j][i]);
+                }
             }
             for (int k = 0; k <= end; k ++) {
                 integral = integral + ped_sub_results[k][i];
+                if (find_features) {
+                    track_pulse(&tracker, position++, ped_sub_results[k][i]);
+                }
             }
             integrals[integral_num][i] = integral;
+            if (find_features) {
+                features[0][i] = tracker.peak;
+                features[1][i] = rel_start + tracker.peak_position;
+                features[2][i] = pulse_cfd_time(&tracker, rel_start);
+            }
+        }
+    }
+    return 0;
+}
+
+int ped_accumulate() {
+    int cell = data_packet.starting_sample_number;
+    uint8_t bank = data_packet.bank;
+    for (int i = 0; i < data_packet.samples_to_be_read + 1; i++) {
+        int32_t * offsets = ped_calibration.offsets[bank][cell];
+        int64_t * sums = ped_calibration.sums[bank][cell];
+        int64_t * sums_sq = ped_calibration.sums_sq[bank][cell];
+        if (ped_calibration.counts[bank][cell] == 0) {
+            for (int j = 0; j < NUM_CHANNELS; j++) {
+                offsets[j] = data_packet.samples[i][j];
+            }
+        }
+        for (int j = 0; j < NUM_CHANNELS; j++) {
+            int32_t delta = (int32_t) data_packet.samples[i][j] - offsets[j];
+            sums[j] += delta;
+            sums_sq[j] += delta * delta;
+        }
+        ped_calibration.counts[bank][cell] += 1;
+        cell += 1;
+        if (cell == NUM_SAMPLES) {
+            cell = 0;
+        }
+    }
+    ped_calibration.num_events += 1;
+    return 0;
+}
+
+// Returns the number of cells that never saw a sample (left at 0).
+int ped_finalize() {
+    int num_empty = 0;
+    for (int b = 0; b < 2; b++) {
+        for (int i = 0; i < NUM_SAMPLES; i++) {
+            uint32_t n = ped_calibration.counts[b][i];
+            if (n == 0) {
+                memset(calibrated_peds[b][i], 0, sizeof(calibrated_peds[b][i]));
+                memset(calibrated_rms[b][i], 0, sizeof(calibrated_rms[b][i]));
+                num_empty++;
+                continue;
+            }
+            for (int j = 0; j < NUM_CHANNELS; j++) {
+                double mean_delta = (double) ped_calibration.sums[b][i][j] / n;
+                double variance = (double) ped_calibration.sums_sq[b][i][j] / n - mean_delta * mean_delta;
+                calibrated_peds[b][i][j] = (uint16_t) (ped_calibration.offsets[b][i][j] + mean_delta + 0.5);
+                calibrated_rms[b][i][j] = (variance > 0) ? (float) sqrt(variance) : 0;
+            }
+        }
+    }
+    return num_empty;
+}
+
+int write_peds_dat(int fd) {
+    FILE * fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        perror("fdopen");
+        return -1;
+    }
+    for (int b = 0; b < 2; b++) {
+        for (int i = 0; i < NUM_SAMPLES; i++) {
+            fprintf(fp, "%d ", i);
+            for (int j = 0; j < NUM_CHANNELS; j++) {
+                fprintf(fp, " %d", calibrated_peds[b][i][j]);
+            }
+            fprintf(fp, "\n");
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+int write_peds_bin(int fd) {
+    struct Peds_Bin_Header header = {PEDS_BIN_MAGIC, 2, NUM_SAMPLES, NUM_CHANNELS, 0, ped_calibration.num_events};
+    if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, calibrated_peds, sizeof(calibrated_peds)) != sizeof(calibrated_peds) ||
+        write(fd, calibrated_rms, sizeof(calibrated_rms)) != sizeof(calibrated_rms)) {
+        perror("write");
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+int peds_bin_to_arrays(int fd) {
+    struct Peds_Bin_Header header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != PEDS_BIN_MAGIC) {
+        printf("Not a binary pedestal file.\n");
+        return -2;
+    }
+    if (header.num_banks != 2 || header.num_samples != NUM_SAMPLES || header.num_channels != NUM_CHANNELS) {
+        printf("Pedestal table is %d x %d x %d, expected 2 x %d x %d.\n", header.num_banks, header.num_samples, header.num_channels, NUM_SAMPLES, NUM_CHANNELS);
+        return -3;
+    }
+    if (read(fd, all_peds, sizeof(all_peds)) != sizeof(all_peds)) {
+        perror("read");
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Reads a peds.dat text table, or a binary table if the name ends in .bin
+int read_peds_file(char * peds_file) {
+    int peds_fd = open(peds_file, 0, "r");
+    if (peds_fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    size_t peds_len = strlen(peds_file);
+    if (peds_len > 4 && strcmp(peds_file + peds_len - 4, ".bin") == 0) {
+        return peds_bin_to_arrays(peds_fd);
+    }
+    return peds_dat_to_arrays(peds_fd);
+}
+
+/*
+ Consumes a pedestal run and writes the averaged tables in both the
+ peds.dat text format and the binary format.
+*/
+int calibrate(char * run_file, char * dat_file, char * bin_file) {
+    int run_fd = open(run_file, 0, "r");
+    if (run_fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    memset(&ped_calibration, 0, sizeof(ped_calibration));
+    int scratch_slot = buffer_pool_acquire(&arena);
+    struct Frame_Stream run_stream;
+    frame_stream_init(&run_stream, run_fd, (uint8_t *) buffer_pool_slot(&arena, scratch_slot));
+    while (data_packet_dat_to_struct(&run_stream) == 0) {
+        ped_accumulate();
+    }
+    // Corrupted and truncated packets are skipped by the framer
+    ped_calibration.num_rejected = run_stream.stats.num_bad;
+    buffer_pool_release(&arena, scratch_slot);
+    close(run_fd);
+
+    int num_empty = ped_finalize();
+    printf("Calibrated from %u events (%u rejected).\n", ped_calibration.num_events, ped_calibration.num_rejected);
+    if (num_empty > 0) {
+        printf("Warning: %d storage cells had no samples and were set to 0.\n", num_empty);
+    }
+
+    int dat_fd = open(dat_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (dat_fd == -1) {
+        perror("open");
+        return -1;
+    }
+    write_peds_dat(dat_fd);
+
+    int bin_fd = open(bin_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (bin_fd == -1) {
+        perror("open");
+        return -1;
+    }
+    write_peds_bin(bin_fd);
+
+    return 0;
+}
+
+int thresholds_dat_to_array(int fd) {
+    FILE * fp = fdopen(fd, "r");
+    if(fp == NULL) {
+        perror("fdopen");
+        return -1;
+    }
+
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        if (fscanf(fp, "%d", &thresholds[j]) != 1) {
+            printf("Thresholds file must hold %d values.\n", NUM_CHANNELS);
+            fclose(fp);
+            return -2;
         }
     }
+    fclose(fp);
     return 0;
 }
 
+// Keeps the channels where any window reaches the channel's threshold and
+// packs their integrals and pulse features into sparse_record. Returns the
+// number of words used.
+int zero_suppress() {
+    uint32_t mask = 0;
+    int record_idx = 1;
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        int keep = 0;
+        for (int i = 0; i < NUM_WINDOWS; i++) {
+            keep |= (integrals[i][j] >= thresholds[j]);
+        }
+        if (keep) {
+            mask |= 1 << j;
+            for (int i = 0; i < NUM_WINDOWS; i++) {
+                sparse_record[record_idx] = integrals[i][j];
+                record_idx++;
+            }
+            for (int f = 0; f < NUM_FEATURES; f++) {
+                sparse_record[record_idx] = features[f][j];
+                record_idx++;
+            }
+        }
+    }
+    sparse_record[0] = mask;
+    return record_idx;
+}
+
 int write_header(int fd, char * field, uint32_t value) {
     char value_ptr[10];
     write(fd, field, strlen(field));
@@ -251,16 +429,38 @@ int write_header(int fd, char * field, uint32_t value) {
     return 0;
 }
 
+// Writes only the channels kept in sparse_record, one line per window
+// followed by one line per pulse feature.
 int write_integrals(int fd, char ** bounds) {
-    char value_ptr[10];
-    for (int i = 0; i < 4; i++) {
-        sprintf(value_ptr, "%d (%s,%s)", i, bounds[i*2], bounds[i*2+1]);
+    char value_ptr[32];
+    char * feature_names[NUM_FEATURES] = {"peak", "peak_time", "cfd_time"};
+    uint32_t mask = sparse_record[0];
+    for (int i = 0; i < CHANNEL_WORDS; i++) {
+        if (i < NUM_WINDOWS) {
+            sprintf(value_ptr, "%d (%s,%s)", i, bounds[i*2], bounds[i*2+1]);
+        }
+        else {
+            sprintf(value_ptr, "%s", feature_names[i-NUM_WINDOWS]);
+        }
         write(fd, value_ptr, strlen(value_ptr));
         write(fd, "   ", 3);
+        int num_kept = 0;
         for (int j = 0; j < NUM_CHANNELS; j++) {
-            sprintf(value_ptr, "%d", integrals[i][j]);
-            write(fd, " ", 1);
-            write(fd, value_ptr, strlen(value_ptr));
+            if (mask & (1 << j)) {
+                int32_t value = sparse_record[1 + num_kept*CHANNEL_WORDS + i];
+                if (i == CHANNEL_WORDS-1 && value == CFD_NO_CROSSING) {
+                    sprintf(value_ptr, "-");
+                }
+                else if (i == CHANNEL_WORDS-1) {
+                    sprintf(value_ptr, "%.2f", (double) value / (1 << CFD_TIME_SHIFT));
+                }
+                else {
+                    sprintf(value_ptr, "%d", value);
+                }
+                write(fd, " ", 1);
+                write(fd, value_ptr, strlen(value_ptr));
+                num_kept++;
+            }
         }
         write(fd, "\n", 1);
     }
@@ -280,41 +480,243 @@ int write_output(int fd, char ** bounds) {
     write_header(fd, "starting_sample_number", data_packet.starting_sample_number);
     write_header(fd, "number_of_missed_triggers", data_packet.number_of_missed_triggers);
     write_header(fd, "state_machine_status", data_packet.state_machine_status);
+    write_header(fd, "channel_mask", sparse_record[0]);
     write_integrals(fd, bounds);
     return 0;
 }
 
 
-int main(int argc, char *argv[]){
-    
-    if (argc != 11) {
-        printf("Usage: %s <data_file> <peds_file> <s1> <e1> <s2> <e2> <s3> <e3> <s4> <e4>\n", argv[0]);
-        printf("       The s# and e# fields represent trigger-relative integral start and end sample values.\n");
+double seconds_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/*
+ Runs every packet of a run through decode, pedestal subtraction and
+ integrals in both layouts, and checks the integrals and features agree.
+ The layouts take turns going first, so neither always finds the frame
+ already in cache. Zero suppression and output are the same for both and
+ left out.
+*/
+int bench_layout(char * run_file, char * peds_file, int * window_bounds) {
+    int run_fd = open(run_file, 0, "r");
+    if (run_fd == -1) {
+        perror("open");
         return -1;
     }
-    
-    int data_packet_fd = open(argv[1], 0, "r");
-    if (data_packet_fd == -1) {
-        perror("open");
+    if (read_peds_file(peds_file) != 0) {
+        return -1;
     }
-    
-    data_packet_dat_to_struct(data_packet_fd);
+    cm_transpose_peds(&all_peds[0][0][0], cm_peds);
+
+    int scratch_slot = buffer_pool_acquire(&arena);
+    struct Frame_Stream run_stream;
+    frame_stream_init(&run_stream, run_fd, (uint8_t *) buffer_pool_slot(&arena, scratch_slot));
+
+    static int32_t cm_integrals_out[NUM_WINDOWS][NUM_CHANNELS];
+    static int32_t cm_features_out[NUM_FEATURES][NUM_CHANNELS];
+    double row_seconds[3] = {0, 0, 0}; // Decode, subtract, integrals
+    double cm_seconds[3] = {0, 0, 0};
+    uint64_t num_packets = 0;
+    uint64_t num_mismatched = 0;
+    uint64_t num_clipped = 0; // Not compared, the model reads outside the waveform
+
+    long frame_bytes;
+    const uint8_t * frame;
+    while ((frame = frame_stream_next(&run_stream, &frame_bytes)) != NULL) {
+        for (int turn = 0; turn < 2; turn++) {
+            double t0 = seconds_now();
+            if (turn == (int) (num_packets & 1)) {
+                frame_decode(frame, &data_packet);
+                double t1 = seconds_now();
+                ped_subtract();
+                double t2 = seconds_now();
+                for (int w = 0; w < NUM_WINDOWS; w++) {
+                    integral(window_bounds[2*w], window_bounds[2*w+1], w);
+                }
+                double t3 = seconds_now();
+                row_seconds[0] += t1 - t0;
+                row_seconds[1] += t2 - t1;
+                row_seconds[2] += t3 - t2;
+            }
+            else {
+                frame_decode_channel_major(frame, &cm_packet);
+                double t1 = seconds_now();
+                cm_ped_subtract(&cm_packet, cm_peds, cm_ped_sub_results);
+                double t2 = seconds_now();
+                cm_integrals(&cm_packet, cm_ped_sub_results, window_bounds, cm_integrals_out, cm_features_out);
+                double t3 = seconds_now();
+                cm_seconds[0] += t1 - t0;
+                cm_seconds[1] += t2 - t1;
+                cm_seconds[2] += t3 - t2;
+            }
+        }
+        if (cm_window_clipped(&cm_packet, window_bounds)) {
+            num_clipped++;
+        }
+        else if (memcmp(integrals, cm_integrals_out, sizeof(integrals)) != 0 || memcmp(features, cm_features_out, sizeof(features)) != 0) {
+            if (num_mismatched == 0) {
+                printf("Packet %lu differs between layouts.\n", (unsigned long) num_packets);
+            }
+            num_mismatched++;
+        }
+        num_packets++;
+    }
+    buffer_pool_release(&arena, scratch_slot);
+    close(run_fd);
+
+    printf("%lu packets, %lu differ between layouts, %lu not compared (a window reaches outside the samples)\n",
+           (unsigned long) num_packets, (unsigned long) num_mismatched, (unsigned long) num_clipped);
+    printf("%-14s %10s %10s %10s %10s %12s\n", "layout", "decode_us", "subtract_us", "integral_us", "total_us", "packets/s");
+    const char * names[2] = {"sample-major", "channel-major"};
+    double * seconds[2] = {row_seconds, cm_seconds};
+    for (int l = 0; l < 2; l++) {
+        double total = seconds[l][0] + seconds[l][1] + seconds[l][2];
+        double per_packet = num_packets ? 1e6 / num_packets : 0.0;
+        printf("%-14s %10.3f %10.3f %10.3f %10.3f %12.0f\n", names[l], seconds[l][0] * per_packet, seconds[l][1] * per_packet,
+               seconds[l][2] * per_packet, total * per_packet, total > 0 ? num_packets / total : 0.0);
+    }
+    return (num_mismatched == 0) ? 0 : -2;
+}
 
-    int json_fd = open("packet.json", O_CREAT | O_RDWR, 0666);
+/*
+ Exports the packets of a run file as NDJSON (packet_json.h), every
+ prescale-th packet with a trigger number from first_trigger to
+ last_trigger. Only the exported packets are subtracted and integrated,
+ every channel kept.
+*/
+int export_json(char * run_file, char * peds_file, int * window_bounds, char * json_file, uint32_t prescale,
+                uint16_t first_trigger, uint16_t last_trigger) {
+    int run_fd = open(run_file, 0, "r");
+    if (run_fd == -1) {
+        perror("open");
+        return -1;
+    }
+    if (read_peds_file(peds_file) != 0) {
+        return -1;
+    }
+    if (channel_major) {
+        cm_transpose_peds(&all_peds[0][0][0], cm_peds);
+    }
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        thresholds[j] = INT32_MIN;
+    }
+    int json_fd = open(json_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
     if (json_fd == -1) {
         perror("open");
+        return -1;
+    }
+    struct Json_Exporter exporter;
+    if (json_exporter_open(&exporter, json_fd, prescale, first_trigger, last_trigger) != 0) {
+        return -1;
+    }
+
+    int scratch_slot = buffer_pool_acquire(&arena);
+    struct Frame_Stream run_stream;
+    frame_stream_init(&run_stream, run_fd, (uint8_t *) buffer_pool_slot(&arena, scratch_slot));
+    double start = seconds_now();
+    int status = 0;
+    long frame_bytes;
+    const uint8_t * frame;
+    while (status == 0 && (frame = frame_stream_next(&run_stream, &frame_bytes)) != NULL) {
+        frame_decode(frame, &data_packet);
+        if (!json_exporter_wants(&exporter, data_packet.trigger_number)) {
+            continue;
+        }
+        if (channel_major) {
+            frame_decode_channel_major(frame, &cm_packet);
+            cm_ped_subtract(&cm_packet, cm_peds, cm_ped_sub_results);
+            cm_integrals(&cm_packet, cm_ped_sub_results, window_bounds, integrals, features);
+        }
+        else {
+            ped_subtract();
+            for (int w = 0; w < NUM_WINDOWS; w++) {
+                integral(window_bounds[2*w], window_bounds[2*w+1], w);
+            }
+        }
+        zero_suppress();
+        status = export_packet(&exporter);
+    }
+    if (json_exporter_close(&exporter) != 0) {
+        status = -1;
     }
+    double seconds = seconds_now() - start;
+    buffer_pool_release(&arena, scratch_slot);
+    close(json_fd);
+    close(run_fd);
+
+    printf("%lu of %lu packets exported to %s, %.1f MB in %.3f s (%.0f packets/s)\n", (unsigned long) exporter.num_exported,
+           (unsigned long) exporter.num_seen, json_file, exporter.bytes_written / 1e6, seconds,
+           seconds > 0 ? exporter.num_exported / seconds : 0.0);
+    return status;
+}
 
-    struct_to_json(json_fd);
+// Left out with -DPRE_PROC_MODEL_LIBRARY, see pre_proc_model.h
+#ifndef PRE_PROC_MODEL_LIBRARY
+int main(int argc, char *argv[]){
 
-    int peds_fd = open(argv[2], 0, "r");
-    if (peds_fd == -1) {
-        perror("open");
+    if (buffer_pool_init(&arena, FRAME_STREAM_BYTES, 1) != 0) {
+        return -1;
+    }
+
+    if (argc == 5 && strcmp(argv[1], "--calibrate") == 0) {
+        return calibrate(argv[2], argv[3], argv[4]);
     }
 
-    peds_dat_to_arrays(peds_fd);
+    if (argc == 12 && strcmp(argv[1], "--bench-layout") == 0) {
+        int window_bounds[2*NUM_WINDOWS];
+        for (int i = 0; i < 2*NUM_WINDOWS; i++) {
+            window_bounds[i] = atoi(argv[4 + i]);
+        }
+        return bench_layout(argv[2], argv[3], window_bounds);
+    }
 
-    ped_subtract();
+    if (argc > 1 && strcmp(argv[1], "--channel-major") == 0) {
+        channel_major = 1;
+        argv++;
+        argc--;
+    }
+
+    if (argc == 16 && strcmp(argv[1], "--export-json") == 0) {
+        int window_bounds[2*NUM_WINDOWS];
+        for (int i = 0; i < 2*NUM_WINDOWS; i++) {
+            window_bounds[i] = atoi(argv[4 + i]);
+        }
+        return export_json(argv[2], argv[3], window_bounds, argv[12], atoi(argv[13]), atoi(argv[14]), atoi(argv[15]));
+    }
+
+    if (argc != 11 && argc != 12) {
+        printf("Usage: %s [--channel-major] <data_file> <peds_file> <s1> <e1> <s2> <e2> <s3> <e3> <s4> <e4> [thresholds_file]\n", argv[0]);
+        printf("       %s --calibrate <pedestal_run_file> <peds_dat_out> <peds_bin_out>\n", argv[0]);
+        printf("       %s --bench-layout <data_file> <peds_file> <s1> <e1> <s2> <e2> <s3> <e3> <s4> <e4>\n", argv[0]);
+        printf("       %s [--channel-major] --export-json <data_file> <peds_file> <s1> <e1> <s2> <e2> <s3> <e3> <s4> <e4>\n", argv[0]);
+        printf("           <json_file> <prescale> <first_trigger> <last_trigger>\n");
+        printf("       The s# and e# fields represent trigger-relative integral start and end sample values.\n");
+        printf("       A peds_file ending in .bin is read as a binary pedestal table.\n");
+        printf("       The thresholds_file holds one zero-suppression threshold per channel.\n");
+        printf("       --channel-major keeps the waveforms channel-major (channel_major.h) from decoding on.\n");
+        printf("       --bench-layout runs every packet through both layouts, checks they agree and times each stage.\n");
+        printf("       --export-json writes every prescale-th packet with a trigger number in [first_trigger, last_trigger]\n");
+        printf("       to json_file, one JSON object per line (packet_json.h). The default run writes the first packet to packet.json.\n");
+        return -1;
+    }
+    
+    int data_packet_fd = open(argv[1], 0, "r");
+    if (data_packet_fd == -1) {
+        perror("open");
+    }
+    
+    int scratch_slot = buffer_pool_acquire(&arena);
+    struct Frame_Stream run_stream;
+    frame_stream_init(&run_stream, data_packet_fd, (uint8_t *) buffer_pool_slot(&arena, scratch_slot));
+    if (data_packet_dat_to_struct(&run_stream) != 0) {
+        printf("No packet found in %s.\n", argv[1]);
+        return -1;
+    }
+    buffer_pool_release(&arena, scratch_slot);
+
+    read_peds_file(argv[2]);
 
     int s1 = atoi(argv[3]);
     int e1 = atoi(argv[4]);
@@ -325,10 +727,46 @@ int main(int argc, char *argv[]){
     int s4 = atoi(argv[9]);
     int e4 = atoi(argv[10]);
 
-    integral(s1, e1, 0);
-    integral(s2, e2, 1);
-    integral(s3, e3, 2);
-    integral(s4, e4, 3);
+    if (channel_major) {
+        int window_bounds[2*NUM_WINDOWS] = {s1, e1, s2, e2, s3, e3, s4, e4};
+        cm_transpose_peds(&all_peds[0][0][0], cm_peds);
+        cm_ped_subtract(&cm_packet, cm_peds, cm_ped_sub_results);
+        cm_integrals(&cm_packet, cm_ped_sub_results, window_bounds, integrals, features);
+    }
+    else {
+        ped_subtract();
+        integral(s1, e1, 0);
+        integral(s2, e2, 1);
+        integral(s3, e3, 2);
+        integral(s4, e4, 3);
+    }
+
+    for (int j = 0; j < NUM_CHANNELS; j++) {
+        thresholds[j] = INT32_MIN; // Keep every channel
+    }
+    if (argc == 12) {
+        int thresholds_fd = open(argv[11], 0, "r");
+        if (thresholds_fd == -1) {
+            perror("open");
+        }
+        else {
+            thresholds_dat_to_array(thresholds_fd);
+        }
+    }
+    zero_suppress();
+
+    int json_fd = open("packet.json", O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (json_fd == -1) {
+        perror("open");
+    }
+    else {
+        struct Json_Exporter exporter;
+        if (json_exporter_open(&exporter, json_fd, 1, 0, UINT16_MAX) == 0) {
+            export_packet(&exporter);
+            json_exporter_close(&exporter);
+        }
+        close(json_fd);
+    }
 
     char * bounds[] = {argv[3], argv[4], argv[5], argv[6], argv[7], argv[8], argv[9], argv[10]};
 
@@ -341,3 +779,4 @@ int main(int argc, char *argv[]){
 
     return 0;
 }
+#endif // PRE_PROC_MODEL_LIBRARY
@@ -0,0 +1,35 @@
+#ifndef PRE_PROC_MODEL_H
+#define PRE_PROC_MODEL_H
+
+#include <stdint.h>
+
+#include "preprocess.h"
+
+/*
+ The C model as a library: pre-proc-model.c built with
+ -DPRE_PROC_MODEL_LIBRARY leaves out its main. It works on globals, one
+ packet at a time: put the packet in data_packet and the pedestals in
+ all_peds, then ped_subtract() and integral() once per window fill
+ integrals and features, and zero_suppress() packs them into
+ sparse_record under thresholds.
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+    extern struct SW_Data_Packet data_packet;
+    extern uint16_t all_peds[2][NUM_SAMPLES][NUM_CHANNELS];
+    extern int16_t ped_sub_results[NUM_SAMPLES][NUM_CHANNELS];
+    extern int32_t integrals[NUM_WINDOWS][NUM_CHANNELS];
+    extern int32_t features[NUM_FEATURES][NUM_CHANNELS];
+    extern int32_t thresholds[NUM_CHANNELS];
+    extern int32_t sparse_record[SPARSE_RECORD_MAX_WORDS];
+
+    int read_peds_file(char * peds_file);
+    int ped_subtract();
+    int integral(int rel_start, int rel_end, int integral_num);
+    int zero_suppress();
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PRE_PROC_MODEL_H
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "preprocess.h"
+#include "preprocess_daemon.h"
+
+int copy_path(char * dest, const char * path) {
+    if (strlen(path) >= DAEMON_PATH_BYTES) {
+        printf("Path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(dest, path);
+    return 0;
+}
+
+double seconds_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]){
+
+    int first_bound = 4;
+    if (argc < first_bound + 2*NUM_WINDOWS || argc > first_bound + 2*NUM_WINDOWS + 4) {
+        printf("Usage: %s <socket> <data_file> <output_file> <start_1> <end_1> ... <start_%d> <end_%d>\n"
+               "       [thresholds_file [archive_file [histogram_file [binning_file]]]]\n",
+               argv[0], NUM_WINDOWS, NUM_WINDOWS);
+        printf("       Submits a job to a running app.exe --daemon and waits for it to finish.\n");
+        printf("       Pass \"\" to skip an optional file.\n");
+        return -1;
+    }
+
+    struct Job_Request request;
+    memset(&request, 0, sizeof(request));
+    request.magic = DAEMON_MAGIC;
+    for (int i = 0; i < 2*NUM_WINDOWS; i++) {
+        request.bounds[i] = atoi(argv[first_bound + i]);
+    }
+    int first_optional = first_bound + 2*NUM_WINDOWS;
+    char * optional_files[4] = {request.thresholds_file, request.archive_file, request.histogram_file, request.binning_file};
+    if (copy_path(request.data_file, argv[2]) != 0 || copy_path(request.output_file, argv[3]) != 0) {
+        return -1;
+    }
+    for (int i = first_optional; i < argc; i++) {
+        if (copy_path(optional_files[i - first_optional], argv[i]) != 0) {
+            return -1;
+        }
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+
+    double start = seconds_now();
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        return -1;
+    }
+    if (write(fd, &request, sizeof(request)) != sizeof(request)) {
+        perror("write");
+        return -1;
+    }
+
+    struct Job_Reply reply;
+    size_t received = 0;
+    while (received < sizeof(reply)) {
+        ssize_t n = read(fd, (uint8_t *) &reply + received, sizeof(reply) - received);
+        if (n <= 0) {
+            printf("Daemon closed the connection without a reply.\n");
+            return -1;
+        }
+        received += n;
+    }
+    double elapsed = seconds_now() - start;
+    close(fd);
+
+    if (reply.magic != DAEMON_MAGIC) {
+        printf("Malformed reply.\n");
+        return -1;
+    }
+    printf("status: %d\n", reply.status);
+    printf("num_events: %lu\n", (unsigned long) reply.num_events);
+    printf("queue_us: %lu\n", (unsigned long) reply.queue_us);
+    printf("run_us: %lu\n", (unsigned long) reply.run_us);
+    printf("round_trip_us: %.0f\n", elapsed * 1e6);
+    return (reply.status == 0) ? 0 : -1;
+}
@@ -1,112 +1,57 @@
-#include <fcntl.h>
-#include <stdio.h>
-#include <unistd.h>
-#include <stdint.h>
-#include <string.h>
-#include <stdlib.h>
+#define PREPROCESS_KERNEL
+#include "preprocess.h"
 
-// char: 8 bit, short: 16 bit, long: 32 bit
+static_assert(Default_Config::ped_sub_bits == PED_SUB_BITS, "PED_SUB_BITS out of sync with Detector_Config");
+static_assert(Default_Config::integral_bits == INTEGRAL_BITS, "INTEGRAL_BITS out of sync with Detector_Config");
+static_assert(Default_Config::sparse_record_max_words == SPARSE_RECORD_MAX_WORDS, "SPARSE_RECORD_MAX_WORDS out of sync with Detector_Config");
 
-#define NUM_CHANNELS 16
-#define NUM_SAMPLES 256 // N
-#define BUF_SIZE 4105 // 8 + N*16 + 1 words (16 bits / 2 bytes per word)
+// 8 channels x 128 samples, e.g. a half-populated test board
+typedef Detector_Config<8, 128, NUM_WINDOWS> Config_8x128;
+typedef Data_Packet<128, 8> Data_Packet_8x128;
 
-/*
- Mimics incoming data packet in C types.
-*/
-struct SW_Data_Packet {
-    uint16_t alpha; // Start Constant 0xA1FA
-    uint8_t i2c_address; // 3 bits
-    uint8_t conf_address; // 4 bits
-    uint8_t bank; // 1 bit, A or B
-    uint8_t fine_time; // 8 bits, sample number when trigger arrives
-    uint32_t coarse_time; // 32 bits
-    uint16_t trigger_number; // 16 bits
-    uint8_t samples_after_trigger; // 8 bits
-    uint8_t look_back_samples; // 8 bits
-    uint8_t samples_to_be_read; // 8 bits
-    uint8_t starting_sample_number; // 8 bits
-    uint8_t number_of_missed_triggers; // 8 bits
-    uint8_t state_machine_status; // 8 bits
-    uint16_t samples[NUM_SAMPLES][NUM_CHANNELS]; // Variable size?
-    // Looks like N samples for 16 channels (so 1 ASIC)
-    uint16_t omega; // End Constant 0x0E6A
-};
-
-int16_t ped_sub_results[NUM_SAMPLES][NUM_CHANNELS] = {0}; // Really 13 bits
-
-
-int ped_subtract(struct SW_Data_Packet * data_packet, uint16_t *all_peds) {
-    int ped_sample_idx = data_packet->starting_sample_number;
-    uint8_t bank = data_packet->bank;
-    for (int i = 0; i < NUM_SAMPLES; i++) {
-        for (int j = 0; j < NUM_CHANNELS; j++) {
-            #pragma HLS PIPELINE II=1
-            ped_sub_results[i][j] = data_packet->samples[i][j] - all_peds[bank*NUM_SAMPLES*NUM_CHANNELS + ped_sample_idx*NUM_CHANNELS + j];
-            if (j==NUM_CHANNELS-1) {
-                ped_sample_idx += 1;
-                if (ped_sample_idx == NUM_SAMPLES) {
-                    ped_sample_idx = 0;
-                }
-            }
-        }
-    }
-    return 0;
-}
-
-int integral(struct SW_Data_Packet * data_packet, int rel_start, int rel_end, int integral_num, int32_t * integrals) {
-    int start = data_packet->fine_time + rel_start - data_packet->starting_sample_number;
-    if (start < 0) {
-        start = start + NUM_SAMPLES - 1;
-    }
-    int end = data_packet->fine_time + rel_end - data_packet->starting_sample_number;
-    if (end >= NUM_SAMPLES - 1) {
-        end = end - (NUM_SAMPLES - 1);
-    }
-    int linear = 0;
-    if (end >= start) {
-        linear = 1;
-    }
-    int32_t temp_integrals[4][NUM_CHANNELS];
-    int32_t current_integral;
-    int i_gte_start = 0;
-    int i_lte_end = 0;
-    for (int i = 0; i < NUM_SAMPLES; i++) {
-        for (int j = 0; j < NUM_CHANNELS; j++) {
-            #pragma HLS PIPELINE II=1
-            current_integral = (i>0) ? temp_integrals[integral_num][j] : 0;
-            i_gte_start = (i >= start);
-            i_lte_end = (i <= end);
-            temp_integrals[integral_num][j] = (i_gte_start && i_lte_end) || (!linear && (i_gte_start || i_lte_end)) ? current_integral + ped_sub_results[i][j] : current_integral;
-            #pragma HLS DEPENDENCE variable=temp_integrals false
-            // I think this should be fine, since it's what they do in the example and it's a WAR dependency...
-        }
-    }
-    // Need to transfer from the temporary buffer to the output
-    for (int i = 0; i < NUM_CHANNELS; i++) {
-        integrals[integral_num*NUM_CHANNELS+i] = temp_integrals[integral_num][i];
-    }
-    return 0;
-}
+// Build with -DCHANNEL_PARALLEL (make CHANNEL_PARALLEL=1) for the one-row-per-clock variant
+#ifdef CHANNEL_PARALLEL
+#define PREPROCESS_BATCH preprocess_batch_parallel
+#else
+#define PREPROCESS_BATCH preprocess_batch
+#endif
 
 extern "C" {
     void preprocess(
-	        struct SW_Data_Packet * input_data_packet, // Read-Only Data Packet Struct
-	        uint16_t *input_all_peds, // Read-Only Pedestals
+	        struct SW_Data_Packet * input_data_packets, // Read-Only Batch of Data Packet Structs
+            int num_packets, // Number of packets in the batch
+	        uint16_t *ped_tables, // Read-Only Pedestals, two generations of PED_TABLE_SIZE
+            unsigned int ped_generation, // Generation to use for the whole batch (slot ped_generation % 2)
             int * bounds, // Read-Only Integral Bounds
-	        int32_t *output_integrals       // Output Result (Integrals)
+            int32_t * thresholds, // Read-Only Zero-Suppression Threshold per Channel
+	        int32_t *output_integrals       // Output Result (Batch header, then a sparse record per packet)
 	        )
     {
-#pragma HLS INTERFACE m_axi port=input_data_packet bundle=aximm1
-#pragma HLS INTERFACE m_axi port=input_all_peds bundle=aximm2
+#pragma HLS INTERFACE m_axi port=input_data_packets bundle=aximm1 max_widen_bitwidth=512
+#pragma HLS INTERFACE m_axi port=ped_tables bundle=aximm2 max_widen_bitwidth=512
 #pragma HLS INTERFACE m_axi port=bounds bundle=aximm3
-#pragma HLS INTERFACE m_axi port=output_integrals bundle=aximm1
+#pragma HLS INTERFACE m_axi port=thresholds bundle=aximm3
+#pragma HLS INTERFACE m_axi port=output_integrals bundle=aximm4
 
-	    ped_subtract(input_data_packet, input_all_peds);
+        PREPROCESS_BATCH<Default_Config>(input_data_packets, num_packets, ped_tables, ped_generation, bounds, thresholds, output_integrals);
+    }
 
-        integral(input_data_packet, bounds[0], bounds[1], 0, output_integrals);
-        integral(input_data_packet, bounds[2], bounds[3], 1, output_integrals);
-        integral(input_data_packet, bounds[4], bounds[5], 2, output_integrals);
-        integral(input_data_packet, bounds[6], bounds[7], 3, output_integrals);
+    void preprocess_8x128(
+	        Data_Packet_8x128 * input_data_packets,
+            int num_packets,
+	        uint16_t *ped_tables,
+            unsigned int ped_generation,
+            int * bounds,
+            int32_t * thresholds,
+	        int32_t *output_integrals
+	        )
+    {
+#pragma HLS INTERFACE m_axi port=input_data_packets bundle=aximm1 max_widen_bitwidth=512
+#pragma HLS INTERFACE m_axi port=ped_tables bundle=aximm2 max_widen_bitwidth=512
+#pragma HLS INTERFACE m_axi port=bounds bundle=aximm3
+#pragma HLS INTERFACE m_axi port=thresholds bundle=aximm3
+#pragma HLS INTERFACE m_axi port=output_integrals bundle=aximm4
+
+        PREPROCESS_BATCH<Config_8x128>(input_data_packets, num_packets, ped_tables, ped_generation, bounds, thresholds, output_integrals);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,561 @@
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+#include <stdint.h>
+
+// char: 8 bit, short: 16 bit, long: 32 bit
+
+/*
+ Default detector configuration (one ASIC). The host and the C model use
+ these directly, and the kernel template is instantiated with them.
+*/
+#define NUM_CHANNELS 16
+#define NUM_SAMPLES 256 // N
+#define NUM_WINDOWS 4 // Integration windows per packet
+#define BUF_SIZE (8 + NUM_SAMPLES*NUM_CHANNELS + 1) // 8 + N*16 + 1 words (16 bits / 2 bytes per word)
+#define PACKET_BYTES (BUF_SIZE * 16 * 2) // One packet in a .dat run file, every bit an ASCII digit and a space
+
+// Real datapath widths
+#define SAMPLE_BITS 12
+#define PED_SUB_BITS 13 // SAMPLE_BITS + sign
+#define INTEGRAL_BITS 21 // PED_SUB_BITS + log2(NUM_SAMPLES)
+
+#define PED_TABLE_SIZE (2*NUM_SAMPLES*NUM_CHANNELS) // Both banks of one pedestal generation
+#define OUTPUT_HEADER_WORDS 2 // Batch header: pedestal generation used, total words written
+#define NUM_FEATURES 3 // Peak, peak time, CFD time
+#define CHANNEL_WORDS (NUM_WINDOWS + NUM_FEATURES) // Per kept channel: integrals, then features
+#define SPARSE_RECORD_MAX_WORDS (1 + CHANNEL_WORDS*NUM_CHANNELS) // Channel mask, then CHANNEL_WORDS per kept channel
+
+#define CFD_DELAY 2 // Samples
+#define CFD_FRACTION_NUM 3 // CFD fraction is CFD_FRACTION_NUM / 2^CFD_FRACTION_SHIFT
+#define CFD_FRACTION_SHIFT 3
+#define CFD_TIME_SHIFT 8 // CFD time is reported in 1/256 samples
+#define CFD_NO_CROSSING INT32_MIN
+
+/*
+ Mimics incoming data packet in C types.
+*/
+#define DATA_PACKET_FIELDS(samples_dim, channels_dim) \
+    uint16_t alpha; /* Start Constant 0xA1FA */ \
+    uint8_t i2c_address; /* 3 bits */ \
+    uint8_t conf_address; /* 4 bits */ \
+    uint8_t bank; /* 1 bit, A or B */ \
+    uint8_t fine_time; /* 8 bits, sample number when trigger arrives */ \
+    uint32_t coarse_time; /* 32 bits */ \
+    uint16_t trigger_number; /* 16 bits */ \
+    uint8_t samples_after_trigger; /* 8 bits */ \
+    uint8_t look_back_samples; /* 8 bits */ \
+    uint8_t samples_to_be_read; /* 8 bits */ \
+    uint8_t starting_sample_number; /* 8 bits */ \
+    uint8_t number_of_missed_triggers; /* 8 bits */ \
+    uint8_t state_machine_status; /* 8 bits */ \
+    uint16_t samples[samples_dim][channels_dim]; /* N samples for each channel */ \
+    uint16_t omega; /* End Constant 0x0E6A */
+
+struct SW_Data_Packet {
+    DATA_PACKET_FIELDS(NUM_SAMPLES, NUM_CHANNELS)
+};
+
+/*
+ Per-channel state for peak finding and a digital constant-fraction
+ discriminator, y = f*x[k] - x[k-CFD_DELAY], fed one sample at a time in
+ time order across the window. The CFD time is the interpolated positive
+ to negative crossing of y most recently seen when the peak was found.
+*/
+struct Pulse_Tracker {
+    int32_t peak;
+    int peak_position;
+    int32_t delay_line[CFD_DELAY];
+    int32_t cfd_prev;
+    int cross_position; // First sample after the crossing, -1 if none yet
+    int32_t cross_before, cross_after;
+    int peak_cross_position;
+    int32_t peak_cross_before, peak_cross_after;
+};
+
+static inline void reset_pulse(struct Pulse_Tracker * t) {
+    t->peak = 0;
+    t->peak_position = 0;
+    for (int d = 0; d < CFD_DELAY; d++) {
+        t->delay_line[d] = 0;
+    }
+    t->cfd_prev = 0;
+    t->cross_position = -1;
+    t->cross_before = 0;
+    t->cross_after = 0;
+    t->peak_cross_position = -1;
+    t->peak_cross_before = 0;
+    t->peak_cross_after = 0;
+}
+
+static inline void track_pulse(struct Pulse_Tracker * t, int position, int32_t x) {
+    int32_t y = x*CFD_FRACTION_NUM - t->delay_line[CFD_DELAY-1]*(1 << CFD_FRACTION_SHIFT);
+    if (position > 0 && t->cfd_prev > 0 && y <= 0) {
+        t->cross_position = position;
+        t->cross_before = t->cfd_prev;
+        t->cross_after = y;
+    }
+    if (position == 0 || x > t->peak) {
+        t->peak = x;
+        t->peak_position = position;
+        t->peak_cross_position = t->cross_position;
+        t->peak_cross_before = t->cross_before;
+        t->peak_cross_after = t->cross_after;
+    }
+    for (int d = CFD_DELAY-1; d > 0; d--) {
+        t->delay_line[d] = t->delay_line[d-1];
+    }
+    t->delay_line[0] = x;
+    t->cfd_prev = y;
+}
+
+// Times are relative to the trigger sample, like the integral bounds.
+static inline int32_t pulse_cfd_time(struct Pulse_Tracker * t, int rel_start) {
+    if (t->peak_cross_position < 0) {
+        return CFD_NO_CROSSING;
+    }
+    int32_t fraction = t->peak_cross_before * (1 << CFD_TIME_SHIFT) / (t->peak_cross_before - t->peak_cross_after);
+    return (rel_start + t->peak_cross_position - 1) * (1 << CFD_TIME_SHIFT) + fraction;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    // Default-configuration kernel, also callable directly on the CPU.
+    void preprocess(struct SW_Data_Packet * input_data_packets, int num_packets, uint16_t *ped_tables, unsigned int ped_generation,
+                    int * bounds, int32_t * thresholds, int32_t *output_integrals);
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+
+constexpr int ceil_log2(int n) {
+    return (n <= 1) ? 0 : 1 + ceil_log2((n + 1) / 2);
+}
+
+/*
+ Compile-time detector configuration. Widths follow from the sample width:
+ one sign bit for the pedestal-subtracted value and log2(samples) bits of
+ growth for a sum over the whole waveform.
+*/
+template <int CHANNELS, int SAMPLES, int WINDOWS, int SAMPLE_W = SAMPLE_BITS>
+struct Detector_Config {
+    static const int num_channels = CHANNELS;
+    static const int num_samples = SAMPLES;
+    static const int num_windows = WINDOWS;
+    static const int sample_bits = SAMPLE_W;
+    static const int ped_sub_bits = SAMPLE_W + 1;
+    static const int integral_bits = SAMPLE_W + 1 + ceil_log2(SAMPLES);
+    static const int ped_table_size = 2*SAMPLES*CHANNELS;
+    static const int channel_words = WINDOWS + NUM_FEATURES;
+    static const int sparse_record_max_words = 1 + (WINDOWS + NUM_FEATURES)*CHANNELS;
+};
+
+template <int SAMPLES, int CHANNELS>
+struct Data_Packet {
+    DATA_PACKET_FIELDS(SAMPLES, CHANNELS)
+};
+
+typedef Detector_Config<NUM_CHANNELS, NUM_SAMPLES, NUM_WINDOWS, SAMPLE_BITS> Default_Config;
+
+#ifdef PREPROCESS_KERNEL
+#include "ap_int.h"
+#include "hls_stream.h"
+#include "hls_streamofblocks.h"
+
+/*
+ Kernel body, parameterized on the detector configuration. PACKET is the
+ packet struct matching CFG's samples and channels.
+
+ A batch runs as four DATAFLOW tasks, load -> subtract -> integrate ->
+ store, each looping over the packets. They hand packets to each other
+ through stream_of_blocks ping-pong buffers, so packet n+1 is loaded and
+ subtracted while packet n is integrated and stored, and a batch costs
+ about num_packets times the slowest stage. ROWS selects the
+ channel-parallel stage bodies, which handle one sample row per clock.
+*/
+
+// Header fields the later stages need once the samples are in a block
+struct Packet_Meta {
+    uint8_t bank;
+    uint8_t fine_time;
+    uint8_t starting_sample_number;
+};
+
+template <class CFG>
+struct Stage_Blocks {
+    typedef ap_uint<CFG::sample_bits> samples_t[CFG::num_samples][CFG::num_channels];
+    typedef ap_int<CFG::ped_sub_bits> ped_sub_t[CFG::num_samples][CFG::num_channels];
+    typedef int32_t results_t[CFG::channel_words][CFG::num_channels]; // Window integrals, then pulse features
+};
+
+template <class CFG>
+void ped_subtract(Packet_Meta meta, typename Stage_Blocks<CFG>::samples_t samples, ap_uint<CFG::sample_bits> all_peds[2][CFG::num_samples][CFG::num_channels],
+                  typename Stage_Blocks<CFG>::ped_sub_t ped_sub_results) {
+    int ped_sample_idx = meta.starting_sample_number;
+    uint8_t bank = meta.bank;
+    for (int i = 0; i < CFG::num_samples; i++) {
+        for (int j = 0; j < CFG::num_channels; j++) {
+            #pragma HLS PIPELINE II=1
+            ped_sub_results[i][j] = samples[i][j] - all_peds[bank][ped_sample_idx][j];
+            if (j==CFG::num_channels-1) {
+                ped_sample_idx += 1;
+                if (ped_sample_idx == CFG::num_samples) {
+                    ped_sample_idx = 0;
+                }
+            }
+        }
+    }
+}
+
+// The bounds arithmetic wraps a window once, which can leave its start
+// outside the samples: past the last one after a late fine_time, where
+// the window is only the wrapped part from sample 0 to end, or before the
+// first. The bounds are only compared, but the walk reads from its start,
+// so it starts at sample 0 then.
+template <class CFG>
+int walk_start(int start) {
+    return (start < 0 || start >= CFG::num_samples) ? 0 : start;
+}
+
+template <class CFG>
+void integral(Packet_Meta meta, typename Stage_Blocks<CFG>::ped_sub_t ped_sub_results,
+              int rel_start, int rel_end, int integral_num, typename Stage_Blocks<CFG>::results_t results, int find_features) {
+    int start = meta.fine_time + rel_start - meta.starting_sample_number;
+    if (start < 0) {
+        start = start + CFG::num_samples - 1;
+    }
+    int end = meta.fine_time + rel_end - meta.starting_sample_number;
+    if (end >= CFG::num_samples - 1) {
+        end = end - (CFG::num_samples - 1);
+    }
+    int linear = 0;
+    if (end >= start) {
+        linear = 1;
+    }
+    ap_int<CFG::integral_bits> temp_integrals[CFG::num_channels];
+    struct Pulse_Tracker trackers[CFG::num_channels];
+    for (int j = 0; j < CFG::num_channels; j++) {
+        reset_pulse(&trackers[j]);
+    }
+    ap_int<CFG::integral_bits> current_integral;
+    int i_gte_start = 0;
+    int i_lte_end = 0;
+    int in_window = 0;
+    // Walk the samples starting at the window start so a wrapped window is
+    // seen in time order (k is the position within the window)
+    int sample_idx = walk_start<CFG>(start);
+    for (int k = 0; k < CFG::num_samples; k++) {
+        for (int j = 0; j < CFG::num_channels; j++) {
+            #pragma HLS PIPELINE II=1
+            current_integral = (k>0) ? temp_integrals[j] : ap_int<CFG::integral_bits>(0);
+            i_gte_start = (sample_idx >= start);
+            i_lte_end = (sample_idx <= end);
+            in_window = (i_gte_start && i_lte_end) || (!linear && (i_gte_start || i_lte_end));
+            temp_integrals[j] = in_window ? ap_int<CFG::integral_bits>(current_integral + ped_sub_results[sample_idx][j]) : current_integral;
+            #pragma HLS DEPENDENCE variable=temp_integrals false
+            // I think this should be fine, since it's what they do in the example and it's a WAR dependency...
+            if (find_features && in_window) {
+                track_pulse(&trackers[j], k, (int32_t) ped_sub_results[sample_idx][j]);
+            }
+            #pragma HLS DEPENDENCE variable=trackers false
+            if (j==CFG::num_channels-1) {
+                sample_idx += 1;
+                if (sample_idx == CFG::num_samples) {
+                    sample_idx = 0;
+                }
+            }
+        }
+    }
+    // Need to transfer from the temporary buffer to the output
+    for (int j = 0; j < CFG::num_channels; j++) {
+        results[integral_num][j] = temp_integrals[j];
+    }
+    if (find_features) {
+        for (int j = 0; j < CFG::num_channels; j++) {
+            results[CFG::num_windows + 0][j] = trackers[j].peak;
+            results[CFG::num_windows + 1][j] = rel_start + trackers[j].peak_position;
+            results[CFG::num_windows + 2][j] = pulse_cfd_time(&trackers[j], rel_start);
+        }
+    }
+}
+
+// Channel-parallel stage bodies: the channel loops are fully unrolled, so a
+// whole sample row is subtracted per clock and the integration walk
+// accumulates all windows for a row per clock.
+template <class CFG>
+void ped_subtract_rows(Packet_Meta meta, typename Stage_Blocks<CFG>::samples_t samples, ap_uint<CFG::sample_bits> all_peds[2][CFG::num_samples][CFG::num_channels],
+                       typename Stage_Blocks<CFG>::ped_sub_t ped_sub_results) {
+    int ped_sample_idx = meta.starting_sample_number;
+    uint8_t bank = meta.bank;
+    for (int i = 0; i < CFG::num_samples; i++) {
+        #pragma HLS PIPELINE II=1
+        for (int j = 0; j < CFG::num_channels; j++) {
+            #pragma HLS UNROLL
+            ped_sub_results[i][j] = samples[i][j] - all_peds[bank][ped_sample_idx][j];
+        }
+        ped_sample_idx = (ped_sample_idx == CFG::num_samples-1) ? 0 : ped_sample_idx + 1;
+    }
+}
+
+// Walks the rows once, starting at the widest window so its pulse features
+// see the samples in time order, and accumulates every window at once.
+template <class CFG>
+void integrate_rows(Packet_Meta meta, typename Stage_Blocks<CFG>::ped_sub_t ped_sub_results,
+                    int bounds[2*CFG::num_windows], typename Stage_Blocks<CFG>::results_t results) {
+    int start[CFG::num_windows];
+    int end[CFG::num_windows];
+    int linear[CFG::num_windows];
+    #pragma HLS ARRAY_PARTITION variable=start complete
+    #pragma HLS ARRAY_PARTITION variable=end complete
+    #pragma HLS ARRAY_PARTITION variable=linear complete
+    ap_int<CFG::integral_bits> integrals[CFG::num_windows][CFG::num_channels];
+    #pragma HLS ARRAY_PARTITION variable=integrals complete
+    for (int w = 0; w < CFG::num_windows; w++) {
+        #pragma HLS UNROLL
+        start[w] = meta.fine_time + bounds[2*w] - meta.starting_sample_number;
+        if (start[w] < 0) {
+            start[w] = start[w] + CFG::num_samples - 1;
+        }
+        end[w] = meta.fine_time + bounds[2*w+1] - meta.starting_sample_number;
+        if (end[w] >= CFG::num_samples - 1) {
+            end[w] = end[w] - (CFG::num_samples - 1);
+        }
+        linear[w] = (end[w] >= start[w]);
+        for (int j = 0; j < CFG::num_channels; j++) {
+            #pragma HLS UNROLL
+            integrals[w][j] = 0;
+        }
+    }
+
+    struct Pulse_Tracker trackers[CFG::num_channels];
+    #pragma HLS ARRAY_PARTITION variable=trackers complete
+    for (int j = 0; j < CFG::num_channels; j++) {
+        #pragma HLS UNROLL
+        reset_pulse(&trackers[j]);
+    }
+
+    const int last = CFG::num_windows - 1;
+    int sample_idx = walk_start<CFG>(start[last]);
+    for (int k = 0; k < CFG::num_samples; k++) {
+        #pragma HLS PIPELINE II=1
+        int in_window[CFG::num_windows];
+        #pragma HLS ARRAY_PARTITION variable=in_window complete
+        for (int w = 0; w < CFG::num_windows; w++) {
+            #pragma HLS UNROLL
+            int i_gte_start = (sample_idx >= start[w]);
+            int i_lte_end = (sample_idx <= end[w]);
+            in_window[w] = (i_gte_start && i_lte_end) || (!linear[w] && (i_gte_start || i_lte_end));
+        }
+        for (int j = 0; j < CFG::num_channels; j++) {
+            #pragma HLS UNROLL
+            ap_int<CFG::ped_sub_bits> x = ped_sub_results[sample_idx][j];
+            for (int w = 0; w < CFG::num_windows; w++) {
+                #pragma HLS UNROLL
+                if (in_window[w]) {
+                    integrals[w][j] += x;
+                }
+            }
+            if (in_window[last]) {
+                track_pulse(&trackers[j], k, (int32_t) x);
+            }
+        }
+        sample_idx = (sample_idx == CFG::num_samples-1) ? 0 : sample_idx + 1;
+    }
+
+    for (int j = 0; j < CFG::num_channels; j++) {
+        #pragma HLS UNROLL
+        for (int w = 0; w < CFG::num_windows; w++) {
+            #pragma HLS UNROLL
+            results[w][j] = integrals[w][j];
+        }
+        results[CFG::num_windows + 0][j] = trackers[j].peak;
+        results[CFG::num_windows + 1][j] = bounds[2*last] + trackers[j].peak_position;
+        results[CFG::num_windows + 2][j] = pulse_cfd_time(&trackers[j], bounds[2*last]);
+    }
+}
+
+// Keeps the channels where any window reaches the channel's threshold.
+// Writes the channel mask followed by the integrals and pulse features of
+// each kept channel and returns the number of words written.
+template <class CFG>
+int zero_suppress(typename Stage_Blocks<CFG>::results_t results, int32_t thresholds[CFG::num_channels], int32_t * record) {
+    uint32_t mask = 0;
+    int record_idx = 1;
+    for (int j = 0; j < CFG::num_channels; j++) {
+        int keep = 0;
+        for (int i = 0; i < CFG::num_windows; i++) {
+            #pragma HLS UNROLL
+            keep |= (results[i][j] >= thresholds[j]);
+        }
+        if (keep) {
+            mask |= 1 << j;
+            for (int i = 0; i < CFG::channel_words; i++) {
+                #pragma HLS PIPELINE II=1
+                record[record_idx] = results[i][j];
+                record_idx++;
+            }
+        }
+    }
+    record[0] = mask;
+    return record_idx;
+}
+
+// Latches the per-batch inputs. The generation is read once per batch, so
+// the host can rewrite the other slot while this batch is running.
+template <class CFG>
+void load_config(uint16_t *ped_tables, unsigned int ped_generation, int * bounds, int32_t * thresholds,
+                 ap_uint<CFG::sample_bits> batch_peds[2][CFG::num_samples][CFG::num_channels],
+                 int batch_bounds[2*CFG::num_windows], int32_t batch_thresholds[CFG::num_channels]) {
+    int slot_base = (ped_generation % 2) * CFG::ped_table_size;
+    for (int r = 0; r < 2*CFG::num_samples; r++) {
+        for (int j = 0; j < CFG::num_channels; j++) {
+            #pragma HLS PIPELINE II=1
+            batch_peds[r / CFG::num_samples][r % CFG::num_samples][j] = ped_tables[slot_base + r*CFG::num_channels + j];
+        }
+    }
+    for (int w = 0; w < 2*CFG::num_windows; w++) {
+        #pragma HLS PIPELINE II=1
+        batch_bounds[w] = bounds[w];
+    }
+    for (int j = 0; j < CFG::num_channels; j++) {
+        #pragma HLS PIPELINE II=1
+        batch_thresholds[j] = thresholds[j];
+    }
+}
+
+template <class CFG, class PACKET, bool ROWS>
+void load_packets(PACKET * input_data_packets, int num_packets,
+                  hls::stream_of_blocks<typename Stage_Blocks<CFG>::samples_t> & samples_out, hls::stream<Packet_Meta> & meta_out) {
+    for (int n = 0; n < num_packets; n++) {
+        hls::write_lock<typename Stage_Blocks<CFG>::samples_t> samples(samples_out);
+        if (ROWS) {
+            for (int i = 0; i < CFG::num_samples; i++) {
+                #pragma HLS PIPELINE II=1
+                for (int j = 0; j < CFG::num_channels; j++) {
+                    #pragma HLS UNROLL
+                    samples[i][j] = input_data_packets[n].samples[i][j];
+                }
+            }
+        }
+        else {
+            for (int i = 0; i < CFG::num_samples; i++) {
+                for (int j = 0; j < CFG::num_channels; j++) {
+                    #pragma HLS PIPELINE II=1
+                    samples[i][j] = input_data_packets[n].samples[i][j];
+                }
+            }
+        }
+        Packet_Meta meta;
+        meta.bank = input_data_packets[n].bank;
+        meta.fine_time = input_data_packets[n].fine_time;
+        meta.starting_sample_number = input_data_packets[n].starting_sample_number;
+        meta_out.write(meta);
+    }
+}
+
+template <class CFG, bool ROWS>
+void subtract_packets(int num_packets, ap_uint<CFG::sample_bits> batch_peds[2][CFG::num_samples][CFG::num_channels],
+                      hls::stream_of_blocks<typename Stage_Blocks<CFG>::samples_t> & samples_in, hls::stream<Packet_Meta> & meta_in,
+                      hls::stream_of_blocks<typename Stage_Blocks<CFG>::ped_sub_t> & ped_sub_out, hls::stream<Packet_Meta> & meta_out) {
+    for (int n = 0; n < num_packets; n++) {
+        Packet_Meta meta = meta_in.read();
+        hls::read_lock<typename Stage_Blocks<CFG>::samples_t> samples(samples_in);
+        hls::write_lock<typename Stage_Blocks<CFG>::ped_sub_t> ped_sub_results(ped_sub_out);
+        if (ROWS) {
+            ped_subtract_rows<CFG>(meta, samples, batch_peds, ped_sub_results);
+        }
+        else {
+            ped_subtract<CFG>(meta, samples, batch_peds, ped_sub_results);
+        }
+        meta_out.write(meta);
+    }
+}
+
+template <class CFG, bool ROWS>
+void integrate_packets(int num_packets, int batch_bounds[2*CFG::num_windows],
+                       hls::stream_of_blocks<typename Stage_Blocks<CFG>::ped_sub_t> & ped_sub_in, hls::stream<Packet_Meta> & meta_in,
+                       hls::stream_of_blocks<typename Stage_Blocks<CFG>::results_t> & results_out) {
+    for (int n = 0; n < num_packets; n++) {
+        Packet_Meta meta = meta_in.read();
+        hls::read_lock<typename Stage_Blocks<CFG>::ped_sub_t> ped_sub_results(ped_sub_in);
+        hls::write_lock<typename Stage_Blocks<CFG>::results_t> results(results_out);
+        if (ROWS) {
+            integrate_rows<CFG>(meta, ped_sub_results, batch_bounds, results);
+        }
+        else {
+            // Peak, peak time and CFD time come from the widest (last) window
+            for (int w = 0; w < CFG::num_windows; w++) {
+                integral<CFG>(meta, ped_sub_results, batch_bounds[2*w], batch_bounds[2*w+1], w, results,
+                              w == CFG::num_windows-1);
+            }
+        }
+    }
+}
+
+// Records are packed back to back, so the host only reads back
+// output_integrals[1] words.
+template <class CFG>
+void store_records(int num_packets, unsigned int ped_generation, int32_t batch_thresholds[CFG::num_channels],
+                   hls::stream_of_blocks<typename Stage_Blocks<CFG>::results_t> & results_in, int32_t *output_integrals) {
+    int output_idx = OUTPUT_HEADER_WORDS;
+    for (int n = 0; n < num_packets; n++) {
+        hls::read_lock<typename Stage_Blocks<CFG>::results_t> results(results_in);
+        output_idx += zero_suppress<CFG>(results, batch_thresholds, output_integrals + output_idx);
+    }
+    output_integrals[0] = ped_generation;
+    output_integrals[1] = output_idx;
+}
+
+template <class CFG, class PACKET>
+void preprocess_batch(PACKET * input_data_packets, int num_packets, uint16_t *ped_tables, unsigned int ped_generation,
+                      int * bounds, int32_t * thresholds, int32_t *output_integrals) {
+    #pragma HLS DATAFLOW
+    ap_uint<CFG::sample_bits> batch_peds[2][CFG::num_samples][CFG::num_channels];
+    int batch_bounds[2*CFG::num_windows];
+    int32_t batch_thresholds[CFG::num_channels];
+    hls::stream_of_blocks<typename Stage_Blocks<CFG>::samples_t> samples_blocks;
+    hls::stream_of_blocks<typename Stage_Blocks<CFG>::ped_sub_t> ped_sub_blocks;
+    hls::stream_of_blocks<typename Stage_Blocks<CFG>::results_t> results_blocks;
+    hls::stream<Packet_Meta> loaded_meta;
+    hls::stream<Packet_Meta> subtracted_meta;
+
+    load_config<CFG>(ped_tables, ped_generation, bounds, thresholds, batch_peds, batch_bounds, batch_thresholds);
+    load_packets<CFG, PACKET, false>(input_data_packets, num_packets, samples_blocks, loaded_meta);
+    subtract_packets<CFG, false>(num_packets, batch_peds, samples_blocks, loaded_meta, ped_sub_blocks, subtracted_meta);
+    integrate_packets<CFG, false>(num_packets, batch_bounds, ped_sub_blocks, subtracted_meta, results_blocks);
+    store_records<CFG>(num_packets, ped_generation, batch_thresholds, results_blocks, output_integrals);
+}
+
+// Channel-parallel variant, the same tasks with the buffers partitioned by
+// channel and the ROWS stage bodies.
+template <class CFG, class PACKET>
+void preprocess_batch_parallel(PACKET * input_data_packets, int num_packets, uint16_t *ped_tables, unsigned int ped_generation,
+                               int * bounds, int32_t * thresholds, int32_t *output_integrals) {
+    #pragma HLS DATAFLOW
+    ap_uint<CFG::sample_bits> batch_peds[2][CFG::num_samples][CFG::num_channels];
+    #pragma HLS ARRAY_PARTITION variable=batch_peds complete dim=3
+    int batch_bounds[2*CFG::num_windows];
+    #pragma HLS ARRAY_PARTITION variable=batch_bounds complete
+    int32_t batch_thresholds[CFG::num_channels];
+    hls::stream_of_blocks<typename Stage_Blocks<CFG>::samples_t> samples_blocks;
+    #pragma HLS ARRAY_PARTITION variable=samples_blocks complete dim=2
+    hls::stream_of_blocks<typename Stage_Blocks<CFG>::ped_sub_t> ped_sub_blocks;
+    #pragma HLS ARRAY_PARTITION variable=ped_sub_blocks complete dim=2
+    hls::stream_of_blocks<typename Stage_Blocks<CFG>::results_t> results_blocks;
+    hls::stream<Packet_Meta> loaded_meta;
+    hls::stream<Packet_Meta> subtracted_meta;
+
+    load_config<CFG>(ped_tables, ped_generation, bounds, thresholds, batch_peds, batch_bounds, batch_thresholds);
+    load_packets<CFG, PACKET, true>(input_data_packets, num_packets, samples_blocks, loaded_meta);
+    subtract_packets<CFG, true>(num_packets, batch_peds, samples_blocks, loaded_meta, ped_sub_blocks, subtracted_meta);
+    integrate_packets<CFG, true>(num_packets, batch_bounds, ped_sub_blocks, subtracted_meta, results_blocks);
+    store_records<CFG>(num_packets, ped_generation, batch_thresholds, results_blocks, output_integrals);
+}
+
+#endif // PREPROCESS_KERNEL
+
+#endif // __cplusplus
+
+#endif // PREPROCESS_H
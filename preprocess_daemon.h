@@ -0,0 +1,38 @@
+#ifndef PREPROCESS_DAEMON_H
+#define PREPROCESS_DAEMON_H
+
+#include <stdint.h>
+
+#include "preprocess.h"
+
+/*
+ Protocol between the host daemon (app.exe --daemon) and
+ preprocess-client over a Unix stream socket. A client sends one
+ Job_Request and gets one Job_Reply when the job has been written out,
+ then the connection is closed. Jobs run one at a time on the device
+ that the daemon programmed at startup. Paths are resolved by the
+ daemon, so relative paths are relative to its working directory.
+*/
+#define DAEMON_MAGIC 0x4a4f4250 // "PBOJ"
+#define DAEMON_PATH_BYTES 256
+
+struct Job_Request {
+    uint32_t magic;
+    int32_t bounds[2*NUM_WINDOWS]; // Trigger-relative window bounds
+    char data_file[DAEMON_PATH_BYTES]; // Run file to process
+    char output_file[DAEMON_PATH_BYTES]; // Text output, written like output.txt
+    char thresholds_file[DAEMON_PATH_BYTES]; // Empty to keep every channel
+    char archive_file[DAEMON_PATH_BYTES]; // Empty for no archive
+    char histogram_file[DAEMON_PATH_BYTES]; // Empty for no histograms
+    char binning_file[DAEMON_PATH_BYTES]; // Empty for the default binning
+};
+
+struct Job_Reply {
+    uint32_t magic;
+    int32_t status; // 0 on success
+    uint64_t num_events;
+    uint64_t queue_us; // From accepting the connection to starting the job
+    uint64_t run_us;
+};
+
+#endif // PREPROCESS_DAEMON_H